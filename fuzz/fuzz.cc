@@ -0,0 +1,232 @@
+//
+// Coverage-guided fuzzing target for f_fat32.
+//
+// A standard disk image is built once with FatFs. For every input, a number of sectors of the boot sector, FSINFO,
+// FAT and data area are corrupted, and then a random sequence of operations is executed on the volume. The image
+// is restored (only the sectors that were written) before the next input.
+//
+// Input format:
+//
+//    byte 0         number of corruptions (0..15)
+//    corruption     region (1 byte), sector (2 bytes), offset (2 bytes), value (4 bytes)
+//    operation...   operation (1 byte), argument (1 byte)
+//
+// Checks (any failure aborts, so the fuzzer records a crash):
+//    - no out-of-bounds access (AddressSanitizer, and every block read, written or discarded must be inside the disk,
+//      or inside the volume as described by the corrupted boot sector - blocks past the end of the image are I/O errors)
+//    - no infinite loops or runaway I/O: each operation must issue at most (2 * sectors in the disk) reads/writes
+//
+
+#include "../src/ffat32.h"
+#include "../test/scenario.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+#define MAX_CORRUPTIONS  16
+#define MAX_OPERATIONS   64
+
+static Scenario* scenario = nullptr;
+static uint32_t  disk_sectors;
+static uint32_t  volume_end;   // first block after the volume, as seen by the library
+static uint32_t  io_count;
+static uint32_t  max_io_per_op;
+
+static const FFat32Op operations[] = {
+    F_FREE, F_FSINFO_RECALC, F_FSINFO_RECALC_STEP, F_BOOT, F_DIR, F_CD, F_MKDIR, F_RMDIR, F_STAT, F_RM, F_MV, F_DEFRAG, F_RMTREE, F_MKDIR_P,
+    F_MKFILES, F_COMPACT, F_DIRINFO, F_FIND,
+};
+
+static const char* paths[] = {
+    "/", "..", "HELLO", "HELLO/", "/HELLO/WORLD", "/HELLO/FORTUNA", "/HELLO/WORLD/HELLO.TXT", "TAGS.TXT",
+    "FORTUNA.DAT", "/NEW", "NEW/SUB", "/HELLO/WORLD/NEW", "/DOES/NOT/EXIST", "FILE*.?", "",
+};
+
+// Returns false if the block is past the end of the image (but inside the volume), like a device would.
+static bool check_block(uint32_t block)
+{
+    if (block >= disk_sectors && block >= volume_end) {
+        fprintf(stderr, "Access to block %u, outside of the disk (%u blocks) and volume.\n", block, disk_sectors);
+        abort();
+    }
+    if (++io_count > max_io_per_op) {
+        fprintf(stderr, "Operation used more than %u sector reads/writes.\n", max_io_per_op);
+        abort();
+    }
+    return block < disk_sectors;
+}
+
+static bool fuzz_write(uint32_t block, uint8_t const* buffer, void* data)
+{
+    if (!check_block(block))
+        return false;
+    Scenario::before_write(block);
+    memcpy(&((uint8_t*) data)[(size_t) block * 512], buffer, 512);
+    return true;
+}
+
+static bool fuzz_read(uint32_t block, uint8_t* buffer, void* data)
+{
+    if (!check_block(block))
+        return false;
+    memcpy(buffer, &((uint8_t const*) data)[(size_t) block * 512], 512);
+    return true;
+}
+
+static void fuzz_discard(uint32_t block, uint32_t count, void*)
+{
+    uint32_t end = std::max(disk_sectors, volume_end);
+    if (count == 0 || block >= end || count > end - block) {
+        fprintf(stderr, "Discard of blocks %u-%u, outside of the disk (%u blocks) and volume.\n", block, block + count - 1, disk_sectors);
+        abort();
+    }
+}
+
+static bool fuzz_write_zeroes(uint32_t block, uint32_t count, void* data)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!check_block(block + i))
+            return false;
+        Scenario::before_write(block + i);
+        memset(&((uint8_t*) data)[(size_t) (block + i) * 512], 0, 512);
+    }
+    return true;
+}
+
+// Reads input bytes; returns zeroes after the end of the input.
+class Input {
+public:
+    Input(uint8_t const* data, size_t size) : data_(data), size_(size) {}
+
+    bool     empty() const { return pos_ >= size_; }
+    uint8_t  u8()  { return pos_ < size_ ? data_[pos_++] : 0; }
+    uint16_t u16() { return u8() | (u8() << 8); }
+    uint32_t u32() { return u16() | ((uint32_t) u16() << 16); }
+
+private:
+    uint8_t const* data_;
+    size_t         size_;
+    size_t         pos_ = 0;
+};
+
+// Overwrite 4 bytes somewhere in the boot sector, FSINFO, FAT or directory/data area.
+static void corrupt(uint8_t* image, FFatRegisters const& reg, Input& input)
+{
+    uint8_t  region = input.u8() % 4;
+    uint16_t sector = input.u16();
+    uint16_t offset = input.u16() % (512 - 3);
+    uint32_t value  = input.u32();
+
+    uint32_t block;
+    switch (region) {
+        case 0:  block = reg.partition_start; break;                                     // boot sector
+        case 1:  block = reg.partition_start + 1; break;                                 // FSINFO
+        case 2:  block = reg.partition_start + reg.fat_sector_start + (sector % reg.fat_size_sectors);
+                 offset &= ~3;                                                            // FAT entry
+                 break;
+        default: block = reg.data_sector_start + (sector % (reg.sectors_per_cluster * 64U)); // first clusters
+    }
+
+    Scenario::before_write(block);
+    memcpy(&image[(size_t) block * 512 + offset], &value, sizeof value);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    if (!scenario) {
+        scenario = new Scenario("Fuzzing", 1, Scenario::DiskState::Complete, 64, 1);
+        disk_sectors = scenario->disk_size * 2048U;
+        max_io_per_op = 2 * disk_sectors;
+    }
+    scenario->prepare_scenario();
+
+    static uint8_t* buffer = new uint8_t[512];
+    FFat32 f {
+        .buffer = buffer,
+        .data = Scenario::image(),
+        .write = fuzz_write,
+        .read = fuzz_read,
+        .discard = fuzz_discard,
+        .write_zeroes = fuzz_write_zeroes,
+        .reg = {},
+    };
+
+    // find out where the structures are, in the uncorrupted image
+    volume_end = disk_sectors;
+    if (f_fat32(&f, F_INIT, 0) != F_OK)
+        abort();
+
+    Input input(data, size);
+    uint8_t corruptions = input.u8() % MAX_CORRUPTIONS;
+    for (uint8_t i = 0; i < corruptions; ++i)
+        corrupt(Scenario::image(), f.reg, input);
+
+    // mount the corrupted image (the boot sector might describe a volume larger than the image)
+    io_count = 0;
+    volume_end = UINT32_MAX;
+    if (f_fat32(&f, F_INIT, 0) != F_OK)
+        return 0;
+    volume_end = (uint32_t) std::min<uint64_t>(UINT32_MAX,
+            f.reg.data_sector_start + (uint64_t) f.reg.total_clusters * f.reg.sectors_per_cluster);
+
+    for (int i = 0; i < MAX_OPERATIONS && !input.empty(); ++i) {
+        FFat32Op op = operations[input.u8() % std::size(operations)];
+        uint8_t  arg = input.u8();
+
+        memset(buffer, 0, 512);
+        if (op == F_DIR || op == F_DIRINFO) {
+            buffer[0] = arg & 1 ? F_CONTINUE : F_START_OVER;
+        } else if (op == F_FSINFO_RECALC_STEP) {
+            buffer[0] = arg & 1 ? F_CONTINUE : F_START_OVER;
+            buffer[1] = arg >> 1;
+        } else if (op == F_MKFILES && arg & 1) {
+            buffer[0] = F_CONTINUE;
+            uint16_t pos = 1;
+            for (uint8_t j = 0; j < arg % 16; ++j) {
+                pos += sprintf((char *) &buffer[pos], "F%u.TXT", j) + 1;
+                uint32_t size = (uint32_t) arg * j * 97;
+                memcpy(&buffer[pos], &size, sizeof size);
+                pos += sizeof size;
+            }
+        } else if (op == F_FIND && arg & 1) {
+            buffer[0] = F_CONTINUE;
+        } else if (op == F_MKFILES || op == F_FIND) {
+            strcpy((char *) &buffer[1], paths[(arg >> 1) % std::size(paths)]);
+        } else if (op == F_MV) {
+            strcpy((char *) buffer, paths[arg % std::size(paths)]);
+            strcpy((char *) &buffer[strlen((char *) buffer) + 1], paths[(arg / 16) % std::size(paths)]);
+        } else {
+            strcpy((char *) buffer, paths[arg % std::size(paths)]);
+        }
+
+        io_count = 0;
+        f_fat32(&f, op, 0);
+    }
+
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+
+// Without libFuzzer (AFL, or reproducing a crash): run each file given in the command line, or stdin.
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        std::vector<uint8_t> data(std::istreambuf_iterator<char>(std::cin), {});
+        return LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        std::ifstream file(argv[i], std::ios::binary);
+        std::vector<uint8_t> data(std::istreambuf_iterator<char>(file), {});
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+}
+
+#endif
@@ -5,7 +5,7 @@ int main()
     FFat32 f;
     f_fat32(&f, F_INIT, 0);
     f_fat32(&f, F_FREE, 0);
-    f_fat32(&f, F_FREE_R, 0);
+    f_fat32(&f, F_FSINFO_RECALC, 0);
     f_fat32(&f, F_CD, 0);
     f_fat32(&f, F_DIR, 0);
     f_fat32(&f, F_MKDIR, 0);
@@ -7,6 +7,10 @@
 #include <stdint.h>
 #include <string.h>
 
+#if defined(FFAT32_THREADS) && !defined(__AVR__)
+#include <pthread.h>
+#endif
+
 /*************/
 /*  GLOBALS  */
 /*************/
@@ -14,6 +18,8 @@
 #define MAX_FILE_PATH 256
 static char global_file_path[MAX_FILE_PATH];
 
+#define MAX_RMTREE_DEPTH 8   // directory levels below the one removed by F_RMTREE
+
 /***********************/
 /*  LOCATIONS ON DISK  */
 /***********************/
@@ -42,7 +48,9 @@ static char global_file_path[MAX_FILE_PATH];
 
 #define FAT_EOF    0x0fffffff
 #define FAT_EOC    0x0ffffff8
+#define FAT_BAD    0x0ffffff7
 #define FAT_FREE   0x0
+#define FAT_ENTRY_MASK 0x0fffffff   /* the upper 4 bits of a FAT entry are reserved */
 
 #define FSI_NO_VALUE      0x0fffffff
 
@@ -54,8 +62,12 @@ static char global_file_path[MAX_FILE_PATH];
 #define DIR_ENTRY_FREE    0x00
 #define DIR_ENTRY_UNUSED  0xe5
 
+#define ATTR_VOLUME_ID   0x08
 #define ATTR_DIR         0x10
 #define ATTR_ARCHIVE     0x20
+#define ATTR_LFN         0x0f   /* read only | hidden | system | volume id */
+
+#define DIR_ENTRY_KANJI   0x05   /* first byte of a name that starts with 0xe5 */
 
 
 /************/
@@ -117,6 +129,24 @@ static inline bool write_data_cluster(FFat32* f, uint32_t cluster, uint16_t sect
     return write_sector(f, (cluster - 2) * f->reg.sectors_per_cluster + f->reg.data_sector_start + sector - f->reg.partition_start);
 }
 
+// Fill the sectors of a data cluster, from `first_sector` to the end of the cluster, with zeroes. Uses a single call to
+// `write_zeroes` if it's available, otherwise writes a zeroed buffer sector by sector.
+static bool zero_data_cluster(FFat32* f, uint32_t cluster, uint16_t first_sector)
+{
+    if (first_sector >= f->reg.sectors_per_cluster)
+        return true;
+    
+    if (f->write_zeroes)
+        return f->write_zeroes((cluster - 2) * f->reg.sectors_per_cluster + f->reg.data_sector_start + first_sector,
+                               f->reg.sectors_per_cluster - first_sector, f->data);
+    
+    memset(f->buffer, 0, BYTES_PER_SECTOR);
+    for (uint16_t sector = first_sector; sector < f->reg.sectors_per_cluster; ++sector)
+        if (!write_data_cluster(f, cluster, sector))
+            return false;
+    return true;
+}
+
 //endregion
 
 /***********************/
@@ -130,53 +160,148 @@ typedef struct {
     uint32_t free_cluster_count;
 } FSInfo;
 
-static FFatResult fat_find_first_free_cluster(FFat32* f, uint32_t fat_cluster_start_at, uint32_t* first_free_cluster_number);
+// Number of FAT sectors that contain entries for clusters in the volume (the FAT might be larger than needed).
+static uint32_t fsinfo_fat_sectors_in_use(FFat32* f)
+{
+    return (f->reg.total_clusters + 2 + FAT_ENTRIES_PER_SECTOR - 1) / FAT_ENTRIES_PER_SECTOR;
+}
 
-// Ignore FSINFO and calculate next free cluster from FAT. Updates FSINFO.
-static FFatResult fsinfo_recalculate_next_free_cluster(FFat32* f, uint32_t* next_free_cluster)
+// Count the free clusters in a FAT sector that was loaded into `fat_sector_data`, adding them to `fs_info`. The first
+// free cluster found is stored in `fs_info->next_free_cluster`, if it was still FSI_NO_VALUE. The two reserved
+// entries and the entries past the last cluster of the volume are ignored.
+static void fsinfo_count_free_entries(FFat32 const* f, uint8_t const* fat_sector_data, uint32_t fat_sector, FSInfo* fs_info)
 {
-    uint32_t first_free_cluster;
-    RETURN_UNLESS_F_OK(fat_find_first_free_cluster(f, 0, &first_free_cluster))
-    
-    TRY_IO(load_sector(f, FSINFO_SECTOR))
-    to_32(f->buffer, FSI_NEXT_FREE, first_free_cluster);
-    TRY_IO(write_sector(f, FSINFO_SECTOR))
+    uint32_t last_cluster = f->reg.total_clusters + 1;
+    
+    for (uint32_t fat_entry_ptr = 0; fat_entry_ptr < FAT_ENTRIES_PER_SECTOR; ++fat_entry_ptr) {   // iterate over all cluster pointers
+        uint32_t cluster = fat_sector * FAT_ENTRIES_PER_SECTOR + fat_entry_ptr;
+        if (cluster < 2 || cluster > last_cluster)
+            continue;
+        if ((from_32(fat_sector_data, fat_entry_ptr * 4) & FAT_ENTRY_MASK) == FAT_FREE) {
+            if (fs_info->next_free_cluster == FSI_NO_VALUE)
+                fs_info->next_free_cluster = cluster;
+            ++fs_info->free_cluster_count;
+        }
+    }
+}
+
+// Count free clusters in `sector_count` FAT sectors starting at `first_fat_sector`, adding them to `fs_info`.
+static FFatResult fsinfo_count_free_clusters(FFat32* f, uint32_t first_fat_sector, uint32_t sector_count, FSInfo* fs_info)
+{
+    for (uint32_t fat_sector = first_fat_sector; fat_sector < first_fat_sector + sector_count; ++fat_sector) {
+        TRY_IO(load_sector(f, f->reg.fat_sector_start + fat_sector))
+        fsinfo_count_free_entries(f, f->buffer, fat_sector, fs_info);
+    }
     
-    *next_free_cluster = first_free_cluster;
     return F_OK;
 }
 
-// Recalculate FSINFO values (next free cluster and total free clusters). Updates FSINFO.
-static FFatResult fsinfo_recalculate(FFat32* f, FSInfo* fs_info)
+#if defined(FFAT32_THREADS) && !defined(__AVR__)
+
+// Host builds only: the FAT is split in FFAT32_THREADS ranges, each one counted by a thread with its own buffer. The
+// read callback must support being called from several threads at the same time.
+
+typedef struct {
+    FFat32 const* f;
+    uint32_t      first_fat_sector;
+    uint32_t      sector_count;
+    FSInfo        fs_info;
+    FFatResult    result;
+} FSInfoWorker;
+
+static void* fsinfo_count_free_clusters_worker(void* arg)
 {
-    fs_info->free_cluster_count = 0;
-    fs_info->next_free_cluster = 0;
+    FSInfoWorker* worker = arg;
+    FFat32 const* f = worker->f;
+    uint8_t buffer[BYTES_PER_SECTOR];
     
-    // free_cluster_count free clusters on FAT
-    uint32_t free_cluster_count = 0;
-    for (uint32_t fat_sector = 0; fat_sector < f->reg.fat_size_sectors; ++fat_sector) {   // iterate over all sectors that make up the FAT
-        TRY_IO(load_sector(f, f->reg.fat_sector_start + fat_sector))
-        for (uint32_t fat_entry_ptr = 0; fat_entry_ptr < BYTES_PER_SECTOR / 4; ++fat_entry_ptr) {   // iterate over all cluster pointers
-            uint32_t data_cluster = from_32(f->buffer, fat_entry_ptr * 4);
-            if (data_cluster == FAT_FREE) {
-                if (fs_info->next_free_cluster == 0)
-                    fs_info->next_free_cluster = data_cluster;
-                ++fs_info->free_cluster_count;
-            }
-            ++free_cluster_count;
+    worker->fs_info = (FSInfo) { .next_free_cluster = FSI_NO_VALUE, .free_cluster_count = 0 };
+    worker->result = F_OK;
+    
+    for (uint32_t fat_sector = worker->first_fat_sector; fat_sector < worker->first_fat_sector + worker->sector_count; ++fat_sector) {
+        if (!f->read(f->reg.partition_start + f->reg.fat_sector_start + fat_sector, buffer, f->data)) {
+            worker->result = F_IO_ERROR;
+            break;
         }
+        fsinfo_count_free_entries(f, buffer, fat_sector, &worker->fs_info);
+    }
+    
+    return NULL;
+}
+
+// Same as fsinfo_count_free_clusters for the whole FAT, but spread over several threads. The results are merged in
+// FAT order, so they are the same as the ones of a single thread.
+static FFatResult fsinfo_count_free_clusters_parallel(FFat32* f, uint32_t sector_count, FSInfo* fs_info)
+{
+    FSInfoWorker workers[FFAT32_THREADS];
+    pthread_t    threads[FFAT32_THREADS];
+    bool         started[FFAT32_THREADS];
+    
+    uint32_t sectors_per_worker = (sector_count + FFAT32_THREADS - 1) / FFAT32_THREADS;
+    for (uint32_t i = 0; i < FFAT32_THREADS; ++i) {
+        uint32_t first = i * sectors_per_worker;
+        workers[i] = (FSInfoWorker) {
+                .f                = f,
+                .first_fat_sector = first,
+                .sector_count     = first >= sector_count ? 0 : sector_count - first,
+        };
+        if (workers[i].sector_count > sectors_per_worker)
+            workers[i].sector_count = sectors_per_worker;
+        
+        started[i] = pthread_create(&threads[i], NULL, fsinfo_count_free_clusters_worker, &workers[i]) == 0;
+        if (!started[i])   // could not create the thread: do this part in the caller
+            fsinfo_count_free_clusters_worker(&workers[i]);
     }
     
-    fs_info->free_cluster_count -= (f->reg.data_sector_start * f->reg.sectors_per_cluster);
+    FFatResult result = F_OK;
+    for (uint32_t i = 0; i < FFAT32_THREADS; ++i) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        if (workers[i].result != F_OK)
+            result = workers[i].result;
+        if (fs_info->next_free_cluster == FSI_NO_VALUE)
+            fs_info->next_free_cluster = workers[i].fs_info.next_free_cluster;
+        fs_info->free_cluster_count += workers[i].fs_info.free_cluster_count;
+    }
     
+    return result;
+}
+
+#endif
+
+// Write both values to FSINFO.
+static FFatResult fsinfo_set(FFat32* f, FSInfo const* fs_info)
+{
     TRY_IO(load_sector(f, FSINFO_SECTOR))
     to_32(f->buffer, FSI_FREE_COUNT, fs_info->free_cluster_count);
     to_32(f->buffer, FSI_NEXT_FREE, fs_info->next_free_cluster);
     TRY_IO(write_sector(f, FSINFO_SECTOR))
-    
     return F_OK;
 }
 
+// Recalculate FSINFO values (next free cluster and total free clusters). Updates FSINFO.
+static FFatResult fsinfo_recalculate(FFat32* f, FSInfo* fs_info)
+{
+    fs_info->free_cluster_count = 0;
+    fs_info->next_free_cluster = FSI_NO_VALUE;
+    
+#if defined(FFAT32_THREADS) && !defined(__AVR__)
+    RETURN_UNLESS_F_OK(fsinfo_count_free_clusters_parallel(f, fsinfo_fat_sectors_in_use(f), fs_info))
+#else
+    RETURN_UNLESS_F_OK(fsinfo_count_free_clusters(f, 0, fsinfo_fat_sectors_in_use(f), fs_info))
+#endif
+    return fsinfo_set(f, fs_info);
+}
+
+// Start the incremental recalculation (F_FSINFO_RECALC_STEP) from the first FAT sector. While no recalculation is in
+// progress, `recalc_next_free_cluster` is 0 (a count in progress has FSI_NO_VALUE or a valid cluster there).
+static void fsinfo_recalc_start_over(FFat32* f)
+{
+    f->reg.recalc_next_fat_sector = 0;
+    f->reg.recalc_next_free_cluster = FSI_NO_VALUE;
+    f->reg.recalc_free_cluster_count = 0;
+}
+
 // Read FSINFO values from disk.
 static FFatResult fsinfo_get(FFat32* f, FSInfo* fs_info)
 {
@@ -186,12 +311,17 @@ static FFatResult fsinfo_get(FFat32* f, FSInfo* fs_info)
     return F_OK;
 }
 
-// Update FSINFO values to disk.
-static FFatResult fsinfo_update(FFat32* f, FSInfo const* fs_info)
+// Add `change_in_size` to the free cluster count, in a single FSINFO read/write. If a cluster was allocated, the next
+// free cluster hint is moved to the cluster after it (wrapping around at the end of the volume); when clusters are
+// freed (`allocated_cluster` == 0), the hint is kept, so it only ever moves forward.
+static FFatResult update_fsinfo(FFat32* f, uint32_t allocated_cluster, int64_t change_in_size)
 {
     TRY_IO(load_sector(f, FSINFO_SECTOR))
-    to_32(f->buffer, FSI_FREE_COUNT, fs_info->free_cluster_count);
-    to_32(f->buffer, FSI_NEXT_FREE, fs_info->next_free_cluster);
+    if (allocated_cluster != 0)
+        to_32(f->buffer, FSI_NEXT_FREE, allocated_cluster > f->reg.total_clusters ? 2 : allocated_cluster + 1);
+    uint32_t current_count = from_32(f->buffer, FSI_FREE_COUNT);
+    if (current_count != 0xffffffff)   // keep "unknown" if the count was not calculated yet
+        to_32(f->buffer, FSI_FREE_COUNT, (int64_t) current_count + change_in_size);
     TRY_IO(write_sector(f, FSINFO_SECTOR))
     return F_OK;
 }
@@ -204,16 +334,117 @@ static FFatResult fsinfo_update(FFat32* f, FSInfo const* fs_info)
 
 // region ...
 
-// Get the data cluster from the FAT based on the cluster number.
+// Check if the cluster number points to a cluster inside the volume.
+static inline bool fat_is_valid_cluster(FFat32* f, uint32_t cluster)
+{
+    return cluster >= 2 && cluster < f->reg.total_clusters + 2;   // excludes free (0) and bad (FAT_BAD) clusters
+}
+
+typedef enum {
+    FAT_ENTRY_FREE,
+    FAT_ENTRY_NEXT,      // link to a cluster inside the volume
+    FAT_ENTRY_EOC,       // end of chain (any value from FAT_EOC to FAT_EOF)
+    FAT_ENTRY_BAD,
+    FAT_ENTRY_INVALID,   // reserved value, or link to a cluster outside the volume
+} FFatEntryType;
+
+// Classify a FAT entry (only the lower 28 bits are used, the upper 4 are reserved).
+static FFatEntryType fat_entry_type(FFat32* f, uint32_t entry)
+{
+    entry &= FAT_ENTRY_MASK;
+    if (entry == FAT_FREE)
+        return FAT_ENTRY_FREE;
+    if (entry >= FAT_EOC)
+        return FAT_ENTRY_EOC;
+    if (entry == FAT_BAD)
+        return FAT_ENTRY_BAD;
+    return fat_is_valid_cluster(f, entry) ? FAT_ENTRY_NEXT : FAT_ENTRY_INVALID;
+}
+
+static inline bool fat_is_eoc(uint32_t entry)
+{
+    return (entry & FAT_ENTRY_MASK) >= FAT_EOC;
+}
+
+// Get the data cluster from the FAT based on the cluster number (the entry is returned with the reserved bits masked).
 static FFatResult fat_get_data_cluster(FFat32* f, uint32_t cluster_number_in_fat, uint32_t* data_cluster)
 {
+    if (!fat_is_valid_cluster(f, cluster_number_in_fat))
+        return F_FAT_CORRUPTED;
+    
     uint32_t cluster_ptr = cluster_number_in_fat * 4;
     uint32_t sector_to_load = cluster_ptr / BYTES_PER_SECTOR;
     
     TRY_IO(load_sector(f, f->reg.fat_sector_start + sector_to_load))
     
-    *data_cluster = from_32(f->buffer, cluster_ptr % BYTES_PER_SECTOR);
+    *data_cluster = from_32(f->buffer, cluster_ptr % BYTES_PER_SECTOR) & FAT_ENTRY_MASK;
+    
+    return F_OK;
+}
+
+// Get the next cluster in a chain, checking if the link is valid. It also counts the clusters visited, so
+// that a loop in the chain is detected when the count gets larger than the number of clusters in the volume.
+// At the end of the chain, `next_cluster` is set to FAT_EOF.
+static FFatResult fat_next_cluster(FFat32* f, uint32_t cluster, uint32_t* next_cluster, uint32_t* cluster_count)
+{
+    if (++(*cluster_count) > f->reg.total_clusters)
+        return F_FAT_CORRUPTED;
+    
+    RETURN_UNLESS_F_OK(fat_get_data_cluster(f, cluster, next_cluster))
+    
+    switch (fat_entry_type(f, *next_cluster)) {
+        case FAT_ENTRY_NEXT: return F_OK;
+        case FAT_ENTRY_EOC:  *next_cluster = FAT_EOF; return F_OK;
+        default:             return F_FAT_CORRUPTED;   // free, bad or invalid link
+    }
+}
+
+// Follow the chain from `cluster` while the clusters are contiguous and their entries are in the same FAT sector, so that
+// a whole run of clusters costs a single FAT read. `last_cluster` is set to the last cluster of the run, and
+// `next_cluster` to the cluster that follows it (FAT_EOF at the end of the chain). Each cluster in the run is counted in
+// `cluster_count`, to detect loops as in fat_next_cluster.
+static FFatResult fat_contiguous_run(FFat32* f, uint32_t cluster, uint32_t* last_cluster, uint32_t* next_cluster, uint32_t* cluster_count)
+{
+    if (++(*cluster_count) > f->reg.total_clusters)
+        return F_FAT_CORRUPTED;
+    
+    uint32_t entry;
+    RETURN_UNLESS_F_OK(fat_get_data_cluster(f, cluster, &entry))
+    
+    while (entry == cluster + 1 && entry % FAT_ENTRIES_PER_SECTOR != 0 && fat_is_valid_cluster(f, entry)) {
+        if (++(*cluster_count) > f->reg.total_clusters)
+            return F_FAT_CORRUPTED;
+        cluster = entry;
+        entry = from_32(f->buffer, (cluster % FAT_ENTRIES_PER_SECTOR) * 4) & FAT_ENTRY_MASK;
+    }
+    
+    *last_cluster = cluster;
+    switch (fat_entry_type(f, entry)) {
+        case FAT_ENTRY_NEXT: *next_cluster = entry;   return F_OK;
+        case FAT_ENTRY_EOC:  *next_cluster = FAT_EOF; return F_OK;
+        default:             return F_FAT_CORRUPTED;   // free, bad or invalid link
+    }
+}
+
+// Set a FAT entry in the loaded FAT sector, keeping its reserved upper 4 bits.
+static inline void fat_set_entry(FFat32* f, uint32_t cluster, uint32_t value)
+{
+    uint16_t pos = (cluster % FAT_ENTRIES_PER_SECTOR) * 4;
+    to_32(f->buffer, pos, (from_32(f->buffer, pos) & ~FAT_ENTRY_MASK) | (value & FAT_ENTRY_MASK));
+}
+
+// Write the FAT sector in the buffer to all FAT copies.
+static FFatResult fat_write_sector(FFat32* f, uint32_t sector_in_fat)
+{
+    // the clusters counted by a FSINFO recalculation in progress might have changed: count them again
+    if (f->reg.recalc_next_free_cluster != 0 && sector_in_fat < f->reg.recalc_next_fat_sector)
+        fsinfo_recalc_start_over(f);
     
+    uint32_t fat_sector = f->reg.fat_sector_start + sector_in_fat;
+    for (uint8_t i = 0; i < f->reg.number_of_fats; ++i) {
+        TRY_IO(write_sector(f, fat_sector))
+        fat_sector += f->reg.fat_size_sectors;
+    }
     return F_OK;
 }
 
@@ -225,50 +456,48 @@ static FFatResult fat_update_data_cluster(FFat32* f, uint32_t cluster_number_in_
     
     // read FAT and replace cluster_number_in_fat
     TRY_IO(load_sector(f, f->reg.fat_sector_start + sector_to_update))
-    to_32(f->buffer, cluster_ptr % BYTES_PER_SECTOR, ptr);
+    fat_set_entry(f, cluster_number_in_fat, ptr);
     
     // write to all FAT copies
-    uint32_t fat_sector = f->reg.fat_sector_start + sector_to_update;
-    for (uint8_t i = 0; i < f->reg.number_of_fats; ++i) {
-        TRY_IO(write_sector(f, fat_sector))
-        fat_sector += f->reg.fat_size_sectors;
-    }
+    RETURN_UNLESS_F_OK(fat_write_sector(f, sector_to_update))
     
     return F_OK;
 }
 
-// Find the first free cluster on FAT.
-static FFatResult fat_find_first_free_cluster(FFat32* f, uint32_t fat_cluster_start_at, uint32_t* first_free_cluster_number)
+// Find a free cluster using a next-fit policy: the search starts at the FSINFO hint (the cluster after the last one
+// allocated), goes up to the last cluster of the volume and wraps around to the first one. Clusters before the hint,
+// that are usually in use, are only scanned when the end of the volume is full.
+static FFatResult fat_find_free_cluster(FFat32* f, uint32_t* free_cluster)
 {
-    uint32_t starting_sector = fat_cluster_start_at / FAT_ENTRIES_PER_SECTOR;
+    FSInfo fs_info;
+    RETURN_UNLESS_F_OK(fsinfo_get(f, &fs_info))
     
-    uint32_t current_cluster_number = starting_sector * FAT_ENTRIES_PER_SECTOR;
+    uint32_t first_cluster = fat_is_valid_cluster(f, fs_info.next_free_cluster) ? fs_info.next_free_cluster : 2;
+    uint32_t last_cluster = f->reg.total_clusters + 1;
     
-    for (uint32_t sector = starting_sector; sector < f->reg.fat_size_sectors; ++sector) {
-        TRY_IO(load_sector(f, f->reg.fat_sector_start + sector))
-        for (uint32_t fat_entry_ptr = 0; fat_entry_ptr < FAT_ENTRIES_PER_SECTOR; ++fat_entry_ptr) {
-            uint32_t pointer = from_32(f->buffer, fat_entry_ptr * sizeof(uint32_t));
-            if (pointer == FAT_FREE) {
-                *first_free_cluster_number = current_cluster_number;
-                return F_OK;
-            }
-            ++current_cluster_number;
+    uint32_t cluster = first_cluster;
+    int64_t last_fat_sector_loaded = -1;
+    do {
+        uint32_t fat_sector = cluster / FAT_ENTRIES_PER_SECTOR;
+        if (fat_sector != last_fat_sector_loaded) {
+            TRY_IO(load_sector(f, f->reg.fat_sector_start + fat_sector))
+            last_fat_sector_loaded = fat_sector;
         }
-    }
+        if ((from_32(f->buffer, (cluster % FAT_ENTRIES_PER_SECTOR) * 4) & FAT_ENTRY_MASK) == FAT_FREE) {
+            *free_cluster = cluster;
+            return F_OK;
+        }
+        cluster = (cluster == last_cluster) ? 2 : cluster + 1;
+    } while (cluster != first_cluster);
     
-    // not found
     return F_DEVICE_FULL;
 }
 
 // Create a new data cluster in the FAT.
 static FFatResult fat_append_cluster(FFat32* f, uint32_t continue_from_cluster, uint32_t* next_free_cluster)
 {
-    // get next cluster from FSINFO
-    FSInfo fs_info;
-    RETURN_UNLESS_F_OK(fsinfo_get(f, &fs_info))
-    
     // find next free cluster (cluster F)
-    RETURN_UNLESS_F_OK(fat_find_first_free_cluster(f, fs_info.next_free_cluster, next_free_cluster))
+    RETURN_UNLESS_F_OK(fat_find_free_cluster(f, next_free_cluster))
     
     // point the previous cluster to cluster F
     RETURN_UNLESS_F_OK(fat_update_data_cluster(f, continue_from_cluster, *next_free_cluster))
@@ -277,44 +506,83 @@ static FFatResult fat_append_cluster(FFat32* f, uint32_t continue_from_cluster,
     RETURN_UNLESS_F_OK(fat_update_data_cluster(f, *next_free_cluster, FAT_EOC))
     
     // update FSINFO
-    fs_info.next_free_cluster = *next_free_cluster;
-    RETURN_UNLESS_F_OK(fsinfo_update(f, &fs_info))
+    RETURN_UNLESS_F_OK(update_fsinfo(f, *next_free_cluster, -1))
     
     return F_OK;
 }
 
-// Remove a file from FAT (follows linked list deleting one by one)
-static FFatResult fat_remove_file(FFat32* f, uint32_t cluster_number, uint32_t* cluster_count)
+// Tell the device that a run of contiguous clusters is not in use anymore (if the `discard` callback is set).
+static void fat_discard_clusters(FFat32* f, uint32_t first_cluster, uint32_t cluster_count)
+{
+    if (f->discard && cluster_count > 0)
+        f->discard((first_cluster - 2) * f->reg.sectors_per_cluster + f->reg.data_sector_start,
+                   cluster_count * f->reg.sectors_per_cluster, f->data);
+}
+
+// Remove files from FAT (follows each linked list deleting one by one). All entries of the chains that are in the loaded
+// FAT sector are freed in the buffer, and the sector is written (to all FAT copies) only when the chains leave it, so
+// chains of files that were allocated together are freed with one write per FAT sector. A sector is written once per
+// visit, though: fragmented chains that go back to a sector they already left write it again. If a chain is corrupted,
+// the clusters up to the invalid link are freed, the other chains are still removed, and F_FAT_CORRUPTED is returned.
+static FFatResult fat_remove_chains(FFat32* f, uint32_t const* first_clusters, uint8_t chain_count, uint32_t* cluster_count)
 {
+    FFatResult result = F_OK;
     int64_t last_fat_sector_loaded = -1;
-    uint32_t next_cluster_to_delete = cluster_number;
+    uint32_t discard_start = 0, discard_count = 0;   // contiguous clusters freed, not yet discarded
     *cluster_count = 0;
     
-    do {
-        // find which sector to load
-        uint32_t cluster_ptr = next_cluster_to_delete * 4;
-        uint32_t sector_to_load = cluster_ptr / BYTES_PER_SECTOR;
-        if (sector_to_load != last_fat_sector_loaded) {
-            if (last_fat_sector_loaded != -1) // save previous iteration
-                TRY_IO(write_sector(f, f->reg.fat_sector_start + last_fat_sector_loaded))
-            TRY_IO(load_sector(f, f->reg.fat_sector_start + sector_to_load))
-            last_fat_sector_loaded = sector_to_load;
-        }
+    for (uint8_t i = 0; i < chain_count; ++i) {
+        uint32_t next_cluster_to_delete = first_clusters[i];
         
-        // find next cluster
-        next_cluster_to_delete = from_32(f->buffer, cluster_ptr % BYTES_PER_SECTOR);
-    
-        // clear cluster in FAT
-        to_32(f->buffer, cluster_ptr % BYTES_PER_SECTOR, FAT_FREE);
-        ++(*cluster_count);
+        do {
+            // a freed cluster is read as free if the chain loops back, but the count also bounds the walk
+            if (!fat_is_valid_cluster(f, next_cluster_to_delete) || *cluster_count >= f->reg.total_clusters) {
+                result = F_FAT_CORRUPTED;
+                break;
+            }
+            
+            // find which sector to load
+            uint32_t cluster_ptr = next_cluster_to_delete * 4;
+            uint32_t sector_to_load = cluster_ptr / BYTES_PER_SECTOR;
+            if (sector_to_load != last_fat_sector_loaded) {
+                if (last_fat_sector_loaded != -1) // save previous iteration
+                    RETURN_UNLESS_F_OK(fat_write_sector(f, last_fat_sector_loaded))
+                TRY_IO(load_sector(f, f->reg.fat_sector_start + sector_to_load))
+                last_fat_sector_loaded = sector_to_load;
+            }
+            
+            // merge the cluster in the run to discard, or start a new run
+            if (next_cluster_to_delete != discard_start + discard_count) {
+                fat_discard_clusters(f, discard_start, discard_count);
+                discard_start = next_cluster_to_delete;
+                discard_count = 0;
+            }
+            ++discard_count;
+            
+            // find next cluster (validated at the start of the next iteration)
+            uint32_t cluster_to_delete = next_cluster_to_delete;
+            next_cluster_to_delete = from_32(f->buffer, cluster_ptr % BYTES_PER_SECTOR) & FAT_ENTRY_MASK;
         
-    } while (next_cluster_to_delete != FAT_EOC && next_cluster_to_delete != FAT_EOF);
+            // clear cluster in FAT
+            fat_set_entry(f, cluster_to_delete, FAT_FREE);
+            ++(*cluster_count);
+            
+        } while (!fat_is_eoc(next_cluster_to_delete));
+    }
     
     // save last iteration
     if (last_fat_sector_loaded != -1)
-        TRY_IO(write_sector(f, f->reg.fat_sector_start + last_fat_sector_loaded))
+        RETURN_UNLESS_F_OK(fat_write_sector(f, last_fat_sector_loaded))
+    fat_discard_clusters(f, discard_start, discard_count);
     
-    return F_OK;
+    return result;
+}
+
+// Remove a file from FAT. If the chain is corrupted, the clusters up to the invalid link are freed and F_FAT_CORRUPTED
+// is returned.
+static FFatResult fat_remove_file(FFat32* f, uint32_t cluster_number, uint32_t* cluster_count)
+{
+    return fat_remove_chains(f, &cluster_number, 1, cluster_count);
 }
 
 // endregion
@@ -328,30 +596,48 @@ static FFatResult fat_remove_file(FFat32* f, uint32_t cluster_number, uint32_t*
 typedef struct FDirResult {
     uint32_t   next_cluster;
     uint16_t   next_sector;
+    uint32_t   cluster_count;      // clusters visited so far (to detect loops in the chain)
+    uint32_t   run_last_cluster;   // last cluster of the contiguous run that contains `next_cluster` (0 = not fetched yet)
+    uint32_t   run_next_cluster;   // cluster after the run (or FAT_EOF)
 } FDirResult;
 
 // Load directory entries sector into the buffer. If it returns F_MORE_DATA, it can be called again with continuation == F_CONTINUE
-// and the last returned `dir_result` to load the whole entry list until it returns F_OK.
-static FFatResult dir(FFat32* f, uint32_t dir_cluster, FContinuation continuation, uint32_t continue_on_cluster, uint16_t continue_on_sector, FDirResult* dir_result)
+// and the last returned `dir_result` to load the whole entry list until it returns F_OK. The chain is fetched one
+// contiguous run at a time (see fat_contiguous_run), so the FAT is read once per fragment of the directory instead of
+// once per cluster.
+static FFatResult dir(FFat32* f, uint32_t dir_cluster, FContinuation continuation, FDirResult* dir_result)
 {
     uint32_t cluster;
     uint16_t sector;
     
-    dir_result->next_cluster = dir_result->next_sector = 0;
-    
     // find current cluster and sector
     if (continuation == F_START_OVER) {   // user has requested to start reading a new directory
         cluster = dir_cluster;
         sector = 0;
+        dir_result->cluster_count = 0;
+        dir_result->run_last_cluster = 0;
     } else {   // user is continuing to read a directory that was started in a previous call
-        cluster = continue_on_cluster;
-        sector = continue_on_sector;
+        cluster = dir_result->next_cluster;
+        sector = dir_result->next_sector;
     }
     
+    dir_result->next_cluster = dir_result->next_sector = 0;
+    
+    if (!fat_is_valid_cluster(f, cluster))
+        return F_FAT_CORRUPTED;
+    
     // move to next cluster and/or sector
     uint32_t next_cluster, next_sector;
     if (sector >= (f->reg.sectors_per_cluster - 1U)) {
-        RETURN_UNLESS_F_OK(fat_get_data_cluster(f, cluster, &next_cluster))
+        if (dir_result->run_last_cluster == 0)   // entering a new run: fetch it
+            RETURN_UNLESS_F_OK(fat_contiguous_run(f, cluster, &dir_result->run_last_cluster, &dir_result->run_next_cluster,
+                                                  &dir_result->cluster_count))
+        if (cluster < dir_result->run_last_cluster) {
+            next_cluster = cluster + 1;
+        } else {
+            next_cluster = dir_result->run_next_cluster;
+            dir_result->run_last_cluster = 0;
+        }
         next_sector = 0;
     } else {
         next_cluster = cluster;
@@ -360,7 +646,7 @@ static FFatResult dir(FFat32* f, uint32_t dir_cluster, FContinuation continuatio
     
     // check if more data is needed
     FFatResult result;
-    if (next_cluster == FAT_EOC || next_cluster == FAT_EOF) {
+    if (next_cluster == FAT_EOF) {
         result = F_OK;
     } else {
         dir_result->next_cluster = next_cluster;
@@ -371,9 +657,15 @@ static FFatResult dir(FFat32* f, uint32_t dir_cluster, FContinuation continuatio
     // load directory data form sector into buffer
     TRY_IO(load_data_cluster(f, cluster, sector))
     
-    // check if we *really* have more data to read (the last dir in array is not null)
-    if (result == F_MORE_DATA && f->buffer[BYTES_PER_SECTOR - DIR_ENTRY_SZ] == '\0') {
-        return F_OK;
+    // check if we *really* have more data to read: an entry starting with 0 marks the end of the directory, even if
+    // the entries after it (in this sector or in the next ones) were not cleared
+    if (result == F_MORE_DATA) {
+        for (uint16_t entry_ptr = 0; entry_ptr < BYTES_PER_SECTOR; entry_ptr += DIR_ENTRY_SZ) {
+            if (f->buffer[entry_ptr + DIR_FILENAME] == DIR_ENTRY_FREE) {
+                dir_result->next_cluster = dir_result->next_sector = 0;
+                return F_OK;
+            }
+        }
     }
     
     return result;
@@ -405,6 +697,27 @@ static void parse_filename(char result[11], char const* filename, size_t filenam
     }
 }
 
+#if !defined(__AVR__)   // host only: only used by F_DIRINFO and F_FIND
+
+// Convert a filename in FAT format to "NAME.EXT" (NUL-terminated).
+static void format_filename(char result[13], char const filename[FILENAME_SZ])
+{
+    uint8_t pos = 0;
+    for (uint8_t i = 0; i < 8 && filename[i] != ' '; ++i)
+        result[pos++] = filename[i];
+    if (filename[8] != ' ') {
+        result[pos++] = '.';
+        for (uint8_t i = 8; i < FILENAME_SZ && filename[i] != ' '; ++i)
+            result[pos++] = filename[i];
+    }
+    result[pos] = '\0';
+    
+    if (result[0] == DIR_ENTRY_KANJI)
+        result[0] = (char) DIR_ENTRY_UNUSED;
+}
+
+#endif
+
 typedef struct FPathLocation {
     uint32_t data_cluster;
     uint32_t parent_dir_cluster;
@@ -429,7 +742,10 @@ static FFatResult find_file_cluster_in_dir_entries_sector(FFat32* f, const char*
             
             // return file/directory data_cluster
             path_location->file_entry_in_parent_dir = entry_ptr;
-            path_location->data_cluster = from_16(f->buffer, entry_ptr + DIR_CLUSTER_LOW) | ((uint32_t) from_16(f->buffer, entry_ptr + DIR_CLUSTER_HIGH) << 8);
+            path_location->data_cluster = (from_16(f->buffer, entry_ptr + DIR_CLUSTER_LOW)
+                    | ((uint32_t) from_16(f->buffer, entry_ptr + DIR_CLUSTER_HIGH) << 16)) & FAT_ENTRY_MASK;
+            if (path_location->data_cluster == 0 && (attr & ATTR_DIR))   // '..' pointing to the root directory (an empty file has no cluster)
+                path_location->data_cluster = f->reg.root_dir_cluster;
             return F_OK;
         }
     }
@@ -437,17 +753,69 @@ static FFatResult find_file_cluster_in_dir_entries_sector(FFat32* f, const char*
     return F_PATH_NOT_FOUND;
 }
 
-// Load cluster containing dir entries from a specific directory cluster and try to find the entry with the specific filename.
-static FFatResult find_file_cluster_in_dir_entries_cluster(FFat32* f, const char* filename, size_t filename_sz, uint32_t dir_entries_cluster,
-                                                           FPathLocation* path_location)
+// Negative lookup cache: the last names (in FAT format) that were not found in a directory, so that looking them up
+// again costs no I/O. A miss is forgotten when an entry with that name is created in (or moved to) the directory, when
+// the cluster of the directory is reused, and when the volume is mounted. The cache is shared by all the FFat32
+// instances, so each miss is kept with the instance where it happened. On AVR there is no cache (it doesn't fit in the
+// code size and RAM budget): every lookup reads the directory.
+#if !defined(__AVR__)
+
+#define NEGATIVE_CACHE_SIZE 4
+
+typedef struct {
+    FFat32 const* f;
+    uint32_t      dir_cluster;   // 0 = unused
+    char          name[FILENAME_SZ];
+} FNegativeCacheEntry;
+
+static FNegativeCacheEntry negative_cache[NEGATIVE_CACHE_SIZE];
+static uint8_t negative_cache_next = 0;   // entry replaced by the next miss
+
+static bool negative_cache_contains(FFat32 const* f, uint32_t dir_cluster, const char name[FILENAME_SZ])
 {
-    // convert filename to FAT format
-    char parsed_filename[FILENAME_SZ];
-    parse_filename(parsed_filename, filename, filename_sz);
+    for (uint8_t i = 0; i < NEGATIVE_CACHE_SIZE; ++i)
+        if (negative_cache[i].f == f && negative_cache[i].dir_cluster == dir_cluster && memcmp(negative_cache[i].name, name, FILENAME_SZ) == 0)
+            return true;
+    return false;
+}
+
+static void negative_cache_add(FFat32 const* f, uint32_t dir_cluster, const char name[FILENAME_SZ])
+{
+    negative_cache[negative_cache_next].f = f;
+    negative_cache[negative_cache_next].dir_cluster = dir_cluster;
+    memcpy(negative_cache[negative_cache_next].name, name, FILENAME_SZ);
+    negative_cache_next = (negative_cache_next + 1) % NEGATIVE_CACHE_SIZE;
+}
+
+// Forget the misses of a name in a directory of the volume (in any directory if `dir_cluster` is 0, of any name if
+// `name` is NULL).
+static void negative_cache_forget(FFat32 const* f, uint32_t dir_cluster, const char* name)
+{
+    for (uint8_t i = 0; i < NEGATIVE_CACHE_SIZE; ++i)
+        if (negative_cache[i].f == f && (dir_cluster == 0 || negative_cache[i].dir_cluster == dir_cluster)
+                && (name == NULL || memcmp(negative_cache[i].name, name, FILENAME_SZ) == 0))
+            negative_cache[i].dir_cluster = 0;
+}
+
+#else
+
+#define negative_cache_contains(f, dir_cluster, name) false
+#define negative_cache_add(f, dir_cluster, name)
+#define negative_cache_forget(f, dir_cluster, name)
+
+#endif
+
+// Load cluster containing dir entries from a specific directory cluster and try to find the entry with the specific
+// filename (already in FAT format).
+static FFatResult find_parsed_file_in_dir(FFat32* f, const char parsed_filename[FILENAME_SZ], uint32_t dir_entries_cluster,
+                                          FPathLocation* path_location)
+{
+    if (negative_cache_contains(f, dir_entries_cluster, parsed_filename))
+        return F_PATH_NOT_FOUND;
     
     // load current directory
     FFatResult result;
-    FDirResult dir_result = { dir_entries_cluster, 0 };
+    FDirResult dir_result = { .next_cluster = dir_entries_cluster };
     FContinuation continuation = F_START_OVER;
     
     do {   // each iteration looks to one sector in the cluster
@@ -456,7 +824,7 @@ static FFatResult find_file_cluster_in_dir_entries_cluster(FFat32* f, const char
         path_location->parent_dir_sector = dir_result.next_sector;
     
         // read directory
-        result = dir(f, dir_entries_cluster, continuation, dir_result.next_cluster, dir_result.next_sector, &dir_result);
+        result = dir(f, dir_entries_cluster, continuation, &dir_result);
         if (result != F_OK && result != F_MORE_DATA)
             return result;
         
@@ -469,19 +837,35 @@ static FFatResult find_file_cluster_in_dir_entries_cluster(FFat32* f, const char
     } while (result == F_MORE_DATA);   // if that was the last sector in the directory cluster containing files, exit loop
     
     // the directory was not found
+    negative_cache_add(f, dir_entries_cluster, parsed_filename);
     return F_PATH_NOT_FOUND;
 }
 
+static FFatResult find_file_cluster_in_dir_entries_cluster(FFat32* f, const char* filename, size_t filename_sz, uint32_t dir_entries_cluster,
+                                                           FPathLocation* path_location)
+{
+    // convert filename to FAT format
+    char parsed_filename[FILENAME_SZ];
+    parse_filename(parsed_filename, filename, filename_sz);
+    
+    return find_parsed_file_in_dir(f, parsed_filename, dir_entries_cluster, path_location);
+}
+
 // Crawl directories until it finds the data index cluster_number for a given path.
 static FFatResult find_path_location(FFat32* f, const char* path, FPathLocation* path_location)
 {
-    // copy file path to a global variable, so we can change it
+    // copy file path to a global variable, so we can change it (the path might already be in this variable)
     size_t len = strlen(path);
     if (len >= MAX_FILE_PATH)
         return F_FILE_PATH_TOO_LONG;
-    strcpy(global_file_path, path);
+    memmove(global_file_path, path, len + 1);
     char* file = global_file_path;
     
+    // the root or the current directory (empty path) have no entry in a parent directory
+    path_location->parent_dir_cluster = 0;
+    path_location->parent_dir_sector = 0;
+    path_location->file_entry_in_parent_dir = 0;
+    
     // find starting cluster_number
     uint32_t current_cluster;
     if (file[0] == '/') {   // absolute path
@@ -543,15 +927,17 @@ typedef struct {
 static void split_path_and_filename(char* file_path, char filename[FILENAME_SZ])
 {
     size_t len = strlen(file_path);
-    if (file_path[len - 1] == '/')   // remove trailing slash
-        file_path[len - 1] = '\0';
+    if (len > 0 && file_path[len - 1] == '/')   // remove trailing slash
+        file_path[--len] = '\0';
     
     char* slash = strrchr(file_path, '/');
     if (slash == NULL) {  // no slash in filename
         parse_filename(filename, file_path, len);
         file_path[0] = '\0';
     } else {
-        parse_filename(filename, slash + 1, slash + 1 - filename + len);
+        parse_filename(filename, slash + 1, strlen(slash + 1));
+        if (slash == file_path)   // the parent is the root directory
+            ++slash;
         *slash = '\0';
     }
 }
@@ -560,6 +946,9 @@ static bool validate_filename(const char filename[FILENAME_SZ])
 {
     static const char* invalid_chars = "\\/:*?\"<>|";
     
+    if (filename[0] == ' ')   // empty filename
+        return false;
+    
     for (uint8_t i = 0; i < FILENAME_SZ; ++i) {
         if (filename[i] < 32)
             return false;
@@ -572,29 +961,6 @@ static bool validate_filename(const char filename[FILENAME_SZ])
     return true;
 }
 
-static FFatResult find_next_free_cluster(FFat32* f, uint32_t* next_free_cluster)
-{
-    // load next free cluster from FSINFO
-    TRY_IO(load_sector(f, FSINFO_SECTOR))
-    uint32_t hint_next_free_cluster = from_32(f->buffer, FSI_NEXT_FREE);
-    
-    // check if value is valid
-    bool recalculate = false;
-    if (hint_next_free_cluster == FSI_NO_VALUE) {
-        recalculate = true;
-    } else {
-        FFatResult result = fat_find_first_free_cluster(f, hint_next_free_cluster, next_free_cluster);
-        if (result != F_OK)
-            recalculate = true;
-    }
-    
-    // recalculate next free cluster in FSINFO, if not valid
-    if (recalculate)
-        RETURN_UNLESS_F_OK(fsinfo_recalculate_next_free_cluster(f, next_free_cluster))
-        
-    return F_OK;
-}
-
 static FFatResult find_next_free_directory_entry(FFat32* f, uint32_t path_cluster, FileEntry* file_entry)
 {
     *file_entry = (FileEntry) {
@@ -603,8 +969,12 @@ static FFatResult find_next_free_directory_entry(FFat32* f, uint32_t path_cluste
             .entry_ptr = 0,
     };
     
+    uint32_t cluster_count = 0;
+    
     // check all dir entries in the cluster
 search_cluster:
+    if (!fat_is_valid_cluster(f, file_entry->cluster))
+        return F_FAT_CORRUPTED;
     for (file_entry->sector = 0; file_entry->sector < f->reg.sectors_per_cluster; ++file_entry->sector) {
         TRY_IO(load_data_cluster(f, file_entry->cluster, file_entry->sector))
         for (file_entry->entry_ptr = 0; file_entry->entry_ptr < BYTES_PER_SECTOR; file_entry->entry_ptr += DIR_ENTRY_SZ) {
@@ -616,8 +986,8 @@ search_cluster:
     
     // if not found, go to next cluster until EOC
     uint32_t next_cluster;
-    RETURN_UNLESS_F_OK(fat_get_data_cluster(f, file_entry->cluster, &next_cluster))
-    if (next_cluster != FAT_EOC && next_cluster != FAT_EOF) {
+    RETURN_UNLESS_F_OK(fat_next_cluster(f, file_entry->cluster, &next_cluster, &cluster_count))
+    if (next_cluster != FAT_EOF) {
         file_entry->cluster = next_cluster;
         goto search_cluster;
     }
@@ -626,26 +996,10 @@ search_cluster:
     return F_PATH_NOT_FOUND;
 }
 
-static FFatResult create_entry_in_directory(FFat32* f, uint32_t parent_dir_data_cluster, char filename[FILENAME_SZ],
-                                            uint8_t attrib, uint16_t fat_datetime, uint32_t data_cluster)
+// Fill a directory entry in the buffer.
+static void set_dir_entry(FFat32* f, uint16_t entry_ptr, char const filename[FILENAME_SZ], uint8_t attrib,
+                          uint32_t fat_datetime, uint32_t data_cluster)
 {
-    // find next free directory entry
-    FileEntry file_entry;
-    FFatResult result = find_next_free_directory_entry(f, parent_dir_data_cluster, &file_entry);
-    
-    // if no directory free entry, append cluster
-    if (result == F_PATH_NOT_FOUND) {
-        RETURN_UNLESS_F_OK(fat_append_cluster(f, parent_dir_data_cluster, &parent_dir_data_cluster))
-        file_entry = (FileEntry) {
-            .cluster = parent_dir_data_cluster,
-            .sector = 0,
-            .entry_ptr = 0,
-        };
-    } else if (result != F_OK) {
-        return result;
-    }
-    
-    // create entry
     FDirEntry dir_entry = {
             .name = { 0 },
             .attrib = attrib,
@@ -653,58 +1007,342 @@ static FFatResult create_entry_in_directory(FFat32* f, uint32_t parent_dir_data_
             .time_tenth = 0,
             .crt_datetime = fat_datetime,
             .last_acc_time = fat_datetime & 0xff,
-            .cluster_high = (data_cluster >> 8),
+            .cluster_high = (data_cluster >> 16),
             .wrt_datetime = fat_datetime,
-            .cluster_low = data_cluster & 0xff,
+            .cluster_low = data_cluster & 0xffff,
             .file_size = 0
     };
     memcpy(dir_entry.name, filename, FILENAME_SZ);
-    memcpy(&f->buffer[file_entry.entry_ptr], &dir_entry, sizeof(FDirEntry));
+    memcpy(&f->buffer[entry_ptr], &dir_entry, sizeof(FDirEntry));
+}
+
+#if !defined(__AVR__)   // only used by F_MV and F_DEFRAG
+
+// Set the first cluster of a directory entry in the buffer.
+static void set_entry_cluster(FFat32* f, uint16_t entry_ptr, uint32_t cluster)
+{
+    FDirEntry* dir_entry = (FDirEntry *) &f->buffer[entry_ptr];
+    dir_entry->cluster_high = cluster >> 16;
+    dir_entry->cluster_low = cluster & 0xffff;
+}
+
+#endif
+
+// Find a free entry in a directory, and load its sector into the buffer. If there's no free entry, a zeroed cluster is
+// appended after the last cluster of the directory (where the search stopped).
+static FFatResult find_or_append_directory_entry(FFat32* f, uint32_t parent_dir_data_cluster, FileEntry* file_entry)
+{
+    FFatResult result = find_next_free_directory_entry(f, parent_dir_data_cluster, file_entry);
     
-    TRY_IO(write_data_cluster(f, file_entry.cluster, file_entry.sector))
+    if (result == F_PATH_NOT_FOUND) {
+        uint32_t new_cluster;
+        RETURN_UNLESS_F_OK(fat_append_cluster(f, file_entry->cluster, &new_cluster))
+        TRY_IO(zero_data_cluster(f, new_cluster, 1))
+        memset(f->buffer, 0, BYTES_PER_SECTOR);
+        *file_entry = (FileEntry) {
+            .cluster = new_cluster,
+            .sector = 0,
+            .entry_ptr = 0,
+        };
+        return F_OK;
+    }
     
-    return F_OK;
+    return result;
 }
 
-static FFatResult update_fsinfo(FFat32* f, uint32_t last_cluster, int64_t change_in_size)
+static FFatResult create_entry_in_directory(FFat32* f, uint32_t parent_dir_data_cluster, char filename[FILENAME_SZ],
+                                            uint8_t attrib, uint32_t fat_datetime, uint32_t data_cluster)
 {
-    TRY_IO(load_sector(f, FSINFO_SECTOR))
-    to_32(f->buffer, FSI_NEXT_FREE, last_cluster);
-    uint32_t current_count = from_32(f->buffer, FSI_FREE_COUNT);
-    to_32(f->buffer, FSI_FREE_COUNT, (int64_t) current_count + change_in_size);
-    TRY_IO(write_sector(f, FSINFO_SECTOR))
+    // find next free directory entry
+    FileEntry file_entry;
+    RETURN_UNLESS_F_OK(find_or_append_directory_entry(f, parent_dir_data_cluster, &file_entry))
+    negative_cache_forget(f, parent_dir_data_cluster, filename);
+    
+    // create entry
+    set_dir_entry(f, file_entry.entry_ptr, filename, attrib, fat_datetime, data_cluster);
+    TRY_IO(write_data_cluster(f, file_entry.cluster, file_entry.sector))
+    
     return F_OK;
 }
 
-static FFatResult create_file_entry(FFat32* f, char* file_path, uint8_t attrib, uint32_t fat_datetime, uint32_t* data_cluster, uint32_t* parent_dir)
+static FFatResult create_file_entry(FFat32* f, uint32_t parent_dir_cluster, char filename[FILENAME_SZ], uint8_t attrib,
+                                    uint32_t fat_datetime, uint32_t* data_cluster)
 {
-    // parse filename and find parent directory cluster
-    char filename[FILENAME_SZ];
-    split_path_and_filename(file_path, filename);
-    FPathLocation path_location;
-    RETURN_UNLESS_F_OK(find_path_location(f, file_path, &path_location))
-    *parent_dir = path_location.data_cluster;
-    
     if (!validate_filename(filename))
         return F_INVALID_FILENAME;
     
     // create a new cluster
-    RETURN_UNLESS_F_OK(find_next_free_cluster(f, data_cluster))
+    RETURN_UNLESS_F_OK(fat_find_free_cluster(f, data_cluster))
     RETURN_UNLESS_F_OK(fat_update_data_cluster(f, *data_cluster, FAT_EOF))
     
     // create directory entry in parent directory
-    RETURN_UNLESS_F_OK(create_entry_in_directory(f, path_location.data_cluster, filename, attrib, fat_datetime, *data_cluster))
+    RETURN_UNLESS_F_OK(create_entry_in_directory(f, parent_dir_cluster, filename, attrib, fat_datetime, *data_cluster))
     
     // update FSINFO
-    RETURN_UNLESS_F_OK(update_fsinfo(f, *data_cluster, +1))
+    RETURN_UNLESS_F_OK(update_fsinfo(f, *data_cluster, -1))
+    
+    return F_OK;
+}
+
+static FFatResult create_directory(FFat32* f, uint32_t parent_dir_cluster, char filename[FILENAME_SZ], uint32_t fat_datetime,
+                                   uint32_t* dir_cluster)
+{
+    // create file entry
+    RETURN_UNLESS_F_OK(create_file_entry(f, parent_dir_cluster, filename, ATTR_DIR, fat_datetime, dir_cluster))
+    negative_cache_forget(f, *dir_cluster, NULL);   // the cluster might have been a directory before
+    
+    // create empty directory structure: '.' and '..' in the first sector, and the rest of the cluster zeroed (so the
+    // directory listing ends after '..'). A '..' pointing to the root directory is stored as cluster 0.
+    TRY_IO(zero_data_cluster(f, *dir_cluster, 1))
+    memset(f->buffer, 0, BYTES_PER_SECTOR);
+    char dot_filename[FILENAME_SZ]; memset(dot_filename, ' ', FILENAME_SZ);
+    dot_filename[0] = '.';
+    set_dir_entry(f, 0, dot_filename, ATTR_DIR, fat_datetime, *dir_cluster);
+    dot_filename[1] = '.';
+    set_dir_entry(f, DIR_ENTRY_SZ, dot_filename, ATTR_DIR, fat_datetime, parent_dir_cluster == f->reg.root_dir_cluster ? 0 : parent_dir_cluster);
+    TRY_IO(write_data_cluster(f, *dir_cluster, 0))
     
     return F_OK;
 }
 
 // endregion
 
-/*****************/
-/*  REMOVE FILE  */
+/*************************/
+/*  CREATE MANY FILES    */
+/*************************/
+
+// region ...
+
+#if !defined(__AVR__)   // host only: doesn't fit in the AVR code size budget
+
+typedef struct __attribute__((__packed__)) {
+    char     name[FILENAME_SZ];
+    uint32_t size;
+    uint32_t cluster;   // first cluster (0 for an empty file)
+} FBatchFile;
+
+#define MAX_BATCH_FILES (MAX_FILE_PATH / sizeof(FBatchFile))   /* = 13, kept in global_file_path */
+
+static uint32_t batch_file_clusters(FFat32* f, FBatchFile const* file)
+{
+    uint32_t bytes_per_cluster = (uint32_t) f->reg.sectors_per_cluster * BYTES_PER_SECTOR;
+    return file->size == 0 ? 0 : (file->size - 1) / bytes_per_cluster + 1;
+}
+
+// Find a run of contiguous free clusters for each (non-empty) file, in a single scan of the FAT from the next free
+// cluster hint. Nothing is written, so if there's not enough space the FAT is left untouched.
+static FFatResult fat_find_free_runs(FFat32* f, FBatchFile* files, uint8_t file_count)
+{
+    FSInfo fs_info;
+    RETURN_UNLESS_F_OK(fsinfo_get(f, &fs_info))
+    
+    uint32_t first_cluster = fat_is_valid_cluster(f, fs_info.next_free_cluster) ? fs_info.next_free_cluster : 2;
+    uint32_t last_cluster = f->reg.total_clusters + 1;
+    
+    uint8_t i = 0;
+    uint32_t run_start = 0, run_length = 0;
+    int64_t last_fat_sector_loaded = -1;
+    uint32_t cluster = first_cluster;
+    
+    do {
+        for (; i < file_count && files[i].size == 0; ++i)   // empty files have no clusters
+            files[i].cluster = 0;
+        if (i == file_count)
+            return F_OK;
+        
+        uint32_t fat_sector = cluster / FAT_ENTRIES_PER_SECTOR;
+        if (fat_sector != last_fat_sector_loaded) {
+            TRY_IO(load_sector(f, f->reg.fat_sector_start + fat_sector))
+            last_fat_sector_loaded = fat_sector;
+        }
+        
+        if (fat_entry_type(f, from_32(f->buffer, (cluster % FAT_ENTRIES_PER_SECTOR) * 4)) != FAT_ENTRY_FREE) {
+            run_length = 0;
+        } else {
+            if (run_length++ == 0)
+                run_start = cluster;
+            if (run_length == batch_file_clusters(f, &files[i])) {
+                files[i++].cluster = run_start;
+                run_length = 0;
+            }
+        }
+        
+        if (cluster == last_cluster) {   // runs don't wrap around the end of the volume
+            cluster = 2;
+            run_length = 0;
+        } else {
+            ++cluster;
+        }
+    } while (cluster != first_cluster);
+    
+    for (; i < file_count && files[i].size == 0; ++i)
+        files[i].cluster = 0;
+    return i == file_count ? F_OK : F_DEVICE_FULL;
+}
+
+// Link the clusters of each run found by fat_find_free_runs. Each FAT sector is written once (runs are in scan order).
+static FFatResult fat_link_runs(FFat32* f, FBatchFile const* files, uint8_t file_count)
+{
+    int64_t last_fat_sector_loaded = -1;
+    
+    for (uint8_t i = 0; i < file_count; ++i) {
+        if (files[i].cluster == 0)
+            continue;
+        uint32_t last_cluster = files[i].cluster + batch_file_clusters(f, &files[i]) - 1;
+        for (uint32_t cluster = files[i].cluster; cluster <= last_cluster; ++cluster) {
+            uint32_t fat_sector = cluster / FAT_ENTRIES_PER_SECTOR;
+            if (fat_sector != last_fat_sector_loaded) {
+                if (last_fat_sector_loaded != -1)
+                    RETURN_UNLESS_F_OK(fat_write_sector(f, last_fat_sector_loaded))
+                TRY_IO(load_sector(f, f->reg.fat_sector_start + fat_sector))
+                last_fat_sector_loaded = fat_sector;
+            }
+            fat_set_entry(f, cluster, cluster == last_cluster ? FAT_EOF : cluster + 1);
+        }
+    }
+    
+    if (last_fat_sector_loaded != -1)
+        RETURN_UNLESS_F_OK(fat_write_sector(f, last_fat_sector_loaded))
+    return F_OK;
+}
+
+// Allocate the clusters of each (non-empty) file one by one, wherever they are free, when fat_find_free_runs can't find
+// a contiguous run for each of them (fragmented volume). The clusters are zeroed as they are allocated, and FSINFO is
+// updated for each of them. If the volume fills up, the clusters allocated so far are freed again.
+static FFatResult fat_allocate_scattered(FFat32* f, FBatchFile* files, uint8_t file_count)
+{
+    FSInfo fs_info;
+    RETURN_UNLESS_F_OK(fsinfo_get(f, &fs_info))
+    uint32_t needed = 0;
+    for (uint8_t i = 0; i < file_count; ++i) {
+        files[i].cluster = 0;
+        needed += batch_file_clusters(f, &files[i]);
+    }
+    if (fs_info.free_cluster_count != 0xffffffff && fs_info.free_cluster_count < needed)
+        return F_DEVICE_FULL;
+    
+    FFatResult result = F_OK;
+    for (uint8_t i = 0; i < file_count && result == F_OK; ++i) {
+        uint32_t cluster_count = batch_file_clusters(f, &files[i]);
+        uint32_t cluster = 0;
+        for (uint32_t j = 0; j < cluster_count && result == F_OK; ++j) {
+            if (j == 0) {
+                result = fat_find_free_cluster(f, &cluster);
+                if (result == F_OK)
+                    result = fat_update_data_cluster(f, cluster, FAT_EOC);
+                if (result == F_OK) {
+                    files[i].cluster = cluster;
+                    result = update_fsinfo(f, cluster, -1);
+                }
+            } else {
+                result = fat_append_cluster(f, cluster, &cluster);
+            }
+            if (result == F_OK && !zero_data_cluster(f, cluster, 0))
+                result = F_IO_ERROR;
+        }
+    }
+    
+    if (result != F_OK) {   // free the chains allocated so far
+        uint32_t chains[MAX_BATCH_FILES], freed = 0;
+        uint8_t chain_count = 0;
+        for (uint8_t i = 0; i < file_count; ++i)
+            if (files[i].cluster != 0)
+                chains[chain_count++] = files[i].cluster;
+        if (chain_count > 0)
+            fat_remove_chains(f, chains, chain_count, &freed);
+        if (freed > 0)
+            update_fsinfo(f, 0, freed);
+    }
+    return result;
+}
+
+// Check that the names of the files are not repeated in the batch, nor in use in the directory (in one scan of it).
+static FFatResult check_batch_names(FFat32* f, uint32_t dir_cluster, FBatchFile const* files, uint8_t file_count)
+{
+    for (uint8_t i = 0; i < file_count; ++i)
+        for (uint8_t j = 0; j < i; ++j)
+            if (memcmp(files[i].name, files[j].name, FILENAME_SZ) == 0)
+                return F_FILE_EXISTS;
+    
+    FFatResult result;
+    FDirResult dir_result = { .next_cluster = dir_cluster };
+    FContinuation continuation = F_START_OVER;
+    
+    do {   // each iteration looks to one sector in the directory
+        result = dir(f, dir_cluster, continuation, &dir_result);
+        if (result != F_OK && result != F_MORE_DATA)
+            return result;
+        
+        for (uint16_t entry_ptr = 0; entry_ptr < BYTES_PER_SECTOR; entry_ptr += DIR_ENTRY_SZ) {
+            uint8_t first_chr = f->buffer[entry_ptr + DIR_FILENAME];
+            if (first_chr == DIR_ENTRY_FREE)
+                break;
+            if (first_chr == DIR_ENTRY_UNUSED || (f->buffer[entry_ptr + DIR_ATTR] & ATTR_LFN) == ATTR_LFN)
+                continue;
+            for (uint8_t i = 0; i < file_count; ++i)
+                if (memcmp(&f->buffer[entry_ptr + DIR_FILENAME], files[i].name, FILENAME_SZ) == 0)
+                    return F_FILE_EXISTS;
+        }
+        
+        continuation = F_CONTINUE;
+        
+    } while (result == F_MORE_DATA);
+    
+    return F_OK;
+}
+
+// Write the entries of the files in the directory opened by F_MKFILES, starting at the sector where the last batch
+// stopped. Each directory sector is written once; if the directory is full, a zeroed cluster is appended to it.
+static FFatResult create_batch_entries(FFat32* f, FBatchFile const* files, uint8_t file_count, uint32_t fat_datetime)
+{
+    uint32_t cluster = f->reg.mkfiles_next_cluster;
+    uint16_t sector = f->reg.mkfiles_next_sector;
+    uint8_t i = 0;
+    
+    while (1) {   // each iteration fills one directory sector
+        TRY_IO(load_data_cluster(f, cluster, sector))
+        
+        bool changed = false;
+        for (uint16_t entry_ptr = 0; entry_ptr < BYTES_PER_SECTOR && i < file_count; entry_ptr += DIR_ENTRY_SZ) {
+            uint8_t first_chr = f->buffer[entry_ptr + DIR_FILENAME];
+            if (first_chr != DIR_ENTRY_FREE && first_chr != DIR_ENTRY_UNUSED)
+                continue;
+            set_dir_entry(f, entry_ptr, files[i].name, ATTR_ARCHIVE, fat_datetime, files[i].cluster);
+            negative_cache_forget(f, f->reg.mkfiles_dir_cluster, files[i].name);
+            ((FDirEntry *) &f->buffer[entry_ptr])->file_size = files[i].size;
+            ++i;
+            changed = true;
+        }
+        if (changed)
+            TRY_IO(write_data_cluster(f, cluster, sector))
+        
+        if (i == file_count)   // the next batch starts in this sector, that might still have free entries
+            break;
+        
+        // go to the next sector, or to the next cluster (appending one if the directory is full)
+        if (++sector == f->reg.sectors_per_cluster) {
+            uint32_t next_cluster;
+            RETURN_UNLESS_F_OK(fat_next_cluster(f, cluster, &next_cluster, &f->reg.mkfiles_cluster_count))
+            if (next_cluster == FAT_EOF) {
+                RETURN_UNLESS_F_OK(fat_append_cluster(f, cluster, &next_cluster))
+                TRY_IO(zero_data_cluster(f, next_cluster, 0))
+            }
+            cluster = next_cluster;
+            sector = 0;
+        }
+    }
+    
+    f->reg.mkfiles_next_cluster = cluster;
+    f->reg.mkfiles_next_sector = sector;
+    return F_OK;
+}
+
+#endif
+
+// endregion
+
+/*****************/
+/*  REMOVE FILE  */
 /*****************/
 
 // region ...
@@ -717,26 +1355,555 @@ static FFatResult mark_file_entry_as_removed(FFat32* f, FPathLocation const* pat
     return F_OK;
 }
 
-static FFatResult remove_file(FFat32* f, FPathLocation const* path_location)
+// Remove a file or directory: the entry is marked as removed first (so an interruption can only lose clusters, never
+// leave an entry pointing to free clusters), then the chain is freed, and then FSINFO is updated. Each of these sectors
+// is written once. `freed_clusters` were already freed before (the contents of a directory), and are added to FSINFO
+// in the same update.
+static FFatResult remove_file(FFat32* f, FPathLocation const* path_location, uint32_t freed_clusters)
 {
+    // update directory entry in parent
+    RETURN_UNLESS_F_OK(mark_file_entry_as_removed(f, path_location))
+    
     // go through linked list in FAT, removing all entries
     // (at the same time, count the number of clusters)
-    uint32_t cluster_count;
-    RETURN_UNLESS_F_OK(fat_remove_file(f, path_location->data_cluster, &cluster_count))
+    uint32_t cluster_count = 0;
+    FFatResult result = F_OK;
+    if (path_location->data_cluster != 0)   // an empty file has no clusters
+        result = fat_remove_file(f, path_location->data_cluster, &cluster_count);
+    if (result != F_OK && result != F_FAT_CORRUPTED)
+        return result;
     
-    // update directory entry in parent
-    RETURN_UNLESS_F_OK(mark_file_entry_as_removed(f, path_location))
+    // (if the chain was corrupted, the file is removed anyway, and the clusters after the invalid link are lost)
     
     // update FSINFO
+    if (cluster_count + freed_clusters > 0)
+        RETURN_UNLESS_F_OK(update_fsinfo(f, 0, +(int64_t) cluster_count + freed_clusters))
+    
+    return result;
+}
+
+#if !defined(__AVR__)   // host only: the stack of directories doesn't fit in the AVR memory
+
+typedef struct {
+    uint32_t dir_cluster;     // first cluster of the directory
+    uint32_t cluster;         // sector being scanned
+    uint16_t sector;
+    uint16_t entry_ptr;       // first entry in the sector not looked at yet
+    uint32_t cluster_count;   // clusters of the directory visited (to detect loops in the chain)
+} FRemoveTreeFrame;
+
+// Remove everything inside a directory, depth first, using a stack of at most MAX_RMTREE_DEPTH directories. The entries
+// in each directory sector are marked as removed and the sector is written once, and then the chains of these entries
+// are freed together. A subdirectory is emptied before its entry is marked as removed (together with the other entries
+// in its sector). Long filename and volume label entries are marked as removed, without a chain. FSINFO is not updated:
+// the number of clusters freed is returned in `freed_clusters`. If a chain is corrupted, the rest of the tree is still
+// removed, and F_FAT_CORRUPTED is returned at the end. The removal is not undone on other errors: if the tree is deeper
+// than the stack, F_FILE_PATH_TOO_LONG is returned after the entries that were visited before the deepest directory
+// were already removed.
+static FFatResult remove_directory_contents(FFat32* f, uint32_t dir_cluster, uint32_t* freed_clusters)
+{
+    FRemoveTreeFrame stack[MAX_RMTREE_DEPTH + 1];
+    uint8_t depth = 0;
+    stack[0] = (FRemoveTreeFrame) { .dir_cluster = dir_cluster, .cluster = dir_cluster };
+    uint32_t removed_subdir = 0;   // subdirectory just emptied, its entry is at `entry_ptr` of the frame below
+    bool corrupted = false;
+    
+    *freed_clusters = 0;
+    
+    while (1) {   // each iteration looks to (part of) one sector of the directory on top of the stack
+        FRemoveTreeFrame* frame = &stack[depth];
+        
+        // load directory sector
+        FDirResult dir_result = {
+                .next_cluster = frame->cluster,
+                .next_sector = frame->sector,
+                .cluster_count = frame->cluster_count,
+        };
+        FFatResult result = dir(f, frame->dir_cluster, F_CONTINUE, &dir_result);
+        if (result != F_OK && result != F_MORE_DATA)
+            return result;
+        bool last_sector = (result == F_OK);
+        
+        // mark entries as removed, and collect their chains
+        uint32_t chains[BYTES_PER_SECTOR / DIR_ENTRY_SZ];
+        uint8_t chain_count = 0;
+        bool changed = false;
+        uint32_t subdir = 0;
+        
+        uint16_t entry_ptr = frame->entry_ptr;
+        if (removed_subdir != 0) {
+            f->buffer[entry_ptr] = DIR_ENTRY_UNUSED;
+            chains[chain_count++] = removed_subdir;
+            changed = true;
+            removed_subdir = 0;
+            entry_ptr += DIR_ENTRY_SZ;
+        }
+        
+        for (; entry_ptr < BYTES_PER_SECTOR; entry_ptr += DIR_ENTRY_SZ) {
+            uint8_t first_chr = f->buffer[entry_ptr + DIR_FILENAME];
+            if (first_chr == DIR_ENTRY_FREE) {   // no more files
+                last_sector = true;
+                break;
+            }
+            if (first_chr == DIR_ENTRY_UNUSED || first_chr == '.')
+                continue;
+            
+            uint8_t attr = f->buffer[entry_ptr + DIR_ATTR];
+            uint32_t cluster = 0;   // long filename and volume label entries have no clusters
+            if ((attr & ATTR_LFN) != ATTR_LFN && !(attr & ATTR_VOLUME_ID))
+                cluster = (from_16(f->buffer, entry_ptr + DIR_CLUSTER_LOW)
+                        | ((uint32_t) from_16(f->buffer, entry_ptr + DIR_CLUSTER_HIGH) << 16)) & FAT_ENTRY_MASK;
+            
+            if (cluster != 0 && !fat_is_valid_cluster(f, cluster)) {   // the entry is removed, but it has no chain to free
+                corrupted = true;
+                cluster = 0;
+            }
+            
+            if ((attr & ATTR_DIR) && cluster != 0) {   // subdirectory: empty it first
+                subdir = cluster;
+                break;
+            }
+            
+            f->buffer[entry_ptr] = DIR_ENTRY_UNUSED;
+            if (cluster != 0)   // an empty file has no clusters
+                chains[chain_count++] = cluster;
+            changed = true;
+        }
+        
+        // write the directory sector once, then free the chains
+        if (changed) {
+            TRY_IO(write_data_cluster(f, frame->cluster, frame->sector))
+            uint32_t count;
+            result = fat_remove_chains(f, chains, chain_count, &count);
+            *freed_clusters += count;
+            if (result == F_FAT_CORRUPTED)
+                corrupted = true;
+            else if (result != F_OK)
+                return result;
+        }
+        
+        if (subdir != 0) {   // go down into the subdirectory
+            if (depth == MAX_RMTREE_DEPTH)
+                return F_FILE_PATH_TOO_LONG;
+            frame->entry_ptr = entry_ptr;
+            stack[++depth] = (FRemoveTreeFrame) { .dir_cluster = subdir, .cluster = subdir };
+        } else if (!last_sector) {   // go to the next sector
+            frame->cluster = dir_result.next_cluster;
+            frame->sector = dir_result.next_sector;
+            frame->cluster_count = dir_result.cluster_count;
+            frame->entry_ptr = 0;
+        } else if (depth > 0) {   // directory is empty: go back up, and remove its entry
+            removed_subdir = frame->dir_cluster;
+            --depth;
+        } else {
+            return corrupted ? F_FAT_CORRUPTED : F_OK;
+        }
+    }
+}
+
+#endif
+
+// endregion
+
+/***********************/
+/*  COMPACT DIRECTORY  */
+/***********************/
+
+// region ...
+
+#if !defined(__AVR__)   // host only: doesn't fit in the AVR code size budget
+
+#define COMPACT_STAGED_ENTRIES (MAX_FILE_PATH / DIR_ENTRY_SZ)   /* = 8, kept in global_file_path */
+
+typedef struct {
+    uint32_t cluster;         // position where the next live entry is written (0 = past the end of the chain)
+    uint16_t sector;
+    uint16_t entry_ptr;
+    uint32_t prev_cluster;    // cluster before `cluster` in the chain (0 = `cluster` is the first one)
+    uint32_t cluster_count;   // clusters visited (to detect loops in the chain)
+} FCompactCursor;
+
+// Move the write cursor to the start of the next directory sector.
+static FFatResult compact_next_sector(FFat32* f, FCompactCursor* w)
+{
+    w->entry_ptr = 0;
+    if (++w->sector < f->reg.sectors_per_cluster)
+        return F_OK;
+    
+    uint32_t next_cluster;
+    RETURN_UNLESS_F_OK(fat_next_cluster(f, w->cluster, &next_cluster, &w->cluster_count))
+    w->prev_cluster = w->cluster;
+    w->cluster = (next_cluster == FAT_EOF) ? 0 : next_cluster;
+    w->sector = 0;
+    return F_OK;
+}
+
+// Write the entries staged in global_file_path at the write cursor, one directory sector at a time.
+static FFatResult compact_flush(FFat32* f, FCompactCursor* w, uint8_t count)
+{
+    uint8_t i = 0;
+    while (i < count) {
+        if (w->cluster == 0)   // the chain changed while it was being compacted
+            return F_FAT_CORRUPTED;
+        TRY_IO(load_data_cluster(f, w->cluster, w->sector))
+        for (; i < count && w->entry_ptr < BYTES_PER_SECTOR; ++i, w->entry_ptr += DIR_ENTRY_SZ)
+            memcpy(&f->buffer[w->entry_ptr], &global_file_path[i * DIR_ENTRY_SZ], DIR_ENTRY_SZ);
+        TRY_IO(write_data_cluster(f, w->cluster, w->sector))
+        if (w->entry_ptr == BYTES_PER_SECTOR)
+            RETURN_UNLESS_F_OK(compact_next_sector(f, w))
+    }
+    return F_OK;
+}
+
+// Rewrite the live entries of a directory densely, in the same order, over the removed (0xE5) entries; write the end
+// marker after the last one, and free the clusters of the chain that are left empty. The entries after the first
+// removed one are staged, 8 at a time, and written back sector by sector; a directory without removed entries is only
+// read. Each entry is written to its new position before its old position is overwritten, so an interruption can
+// leave an entry duplicated, but never lost. FSINFO is not updated: the number of clusters freed is returned in
+// `freed_clusters`.
+static FFatResult compact_directory(FFat32* f, uint32_t dir_cluster, uint32_t* freed_clusters)
+{
+    FCompactCursor w = { 0 };
+    bool moving = false;        // a removed entry was found: the live entries after it are moved
+    bool end = false;           // the end marker was found
+    bool removed = false;       // a removed entry was found (otherwise the entries are already in place)
+    uint8_t staged = 0;
+    uint32_t prev_cluster = 0;  // cluster before the one being read
+    
+    *freed_clusters = 0;
+    
+    FFatResult result;
+    FDirResult dir_result = { .next_cluster = dir_cluster };
+    FContinuation continuation = F_START_OVER;
+    
+    do {   // each iteration reads one sector in the directory
+        uint32_t cluster = dir_result.next_cluster;
+        uint16_t sector = dir_result.next_sector;
+        
+        result = dir(f, dir_cluster, continuation, &dir_result);
+        if (result != F_OK && result != F_MORE_DATA)
+            return result;
+        
+        for (uint16_t entry_ptr = 0; entry_ptr < BYTES_PER_SECTOR; entry_ptr += DIR_ENTRY_SZ) {
+            uint8_t first_chr = f->buffer[entry_ptr + DIR_FILENAME];
+            if (first_chr == DIR_ENTRY_FREE || first_chr == DIR_ENTRY_UNUSED) {
+                if (!moving)   // live entries are written from here on
+                    w = (FCompactCursor) { cluster, sector, entry_ptr, prev_cluster, dir_result.cluster_count };
+                moving = true;
+                if (first_chr == DIR_ENTRY_FREE) {
+                    end = true;
+                    break;
+                }
+                removed = true;
+                continue;
+            }
+            if (!moving)   // entry is already in place
+                continue;
+            
+            memcpy(&global_file_path[staged++ * DIR_ENTRY_SZ], &f->buffer[entry_ptr], DIR_ENTRY_SZ);
+            if (staged == COMPACT_STAGED_ENTRIES) {
+                RETURN_UNLESS_F_OK(compact_flush(f, &w, staged))
+                staged = 0;
+                TRY_IO(load_data_cluster(f, cluster, sector))
+            }
+        }
+        
+        if (result == F_MORE_DATA && dir_result.next_cluster != cluster)
+            prev_cluster = cluster;
+        continuation = F_CONTINUE;
+        
+    } while (result == F_MORE_DATA && !end);
+    
+    if (!moving)   // directory is full
+        return F_OK;
+    RETURN_UNLESS_F_OK(compact_flush(f, &w, staged))
+    if (w.cluster == 0)
+        return F_FAT_CORRUPTED;
+    
+    // clear the rest of the last cluster with entries, where entries were moved from (without removed entries, the end
+    // marker is already after the last entry)
+    uint32_t last_cluster = w.cluster;
+    if (w.entry_ptr == 0 && w.sector == 0 && w.prev_cluster != 0) {   // the cluster is left empty: it's freed below
+        last_cluster = w.prev_cluster;
+    } else if (removed && w.entry_ptr == 0) {
+        TRY_IO(zero_data_cluster(f, w.cluster, w.sector))
+    } else if (removed) {
+        TRY_IO(load_data_cluster(f, w.cluster, w.sector))
+        memset(&f->buffer[w.entry_ptr], 0, BYTES_PER_SECTOR - w.entry_ptr);
+        TRY_IO(write_data_cluster(f, w.cluster, w.sector))
+        TRY_IO(zero_data_cluster(f, w.cluster, w.sector + 1))
+    }
+    
+    // end the chain at the last cluster, and free the clusters after it
+    uint32_t next_cluster;
+    RETURN_UNLESS_F_OK(fat_get_data_cluster(f, last_cluster, &next_cluster))
+    if (fat_is_eoc(next_cluster))
+        return F_OK;
+    if (fat_entry_type(f, next_cluster) != FAT_ENTRY_NEXT)
+        return F_FAT_CORRUPTED;
+    RETURN_UNLESS_F_OK(fat_update_data_cluster(f, last_cluster, FAT_EOF))
+    return fat_remove_file(f, next_cluster, freed_clusters);
+}
+
+#endif
+
+// endregion
+
+/***************/
+/*  MOVE FILE  */
+/***************/
+
+// region ...
+
+#if !defined(__AVR__)   // host only: doesn't fit in the AVR code size budget
+
+// Check if the directory `dir_cluster` is `ancestor_cluster`, or is inside it, by following the '..' entries up to the root.
+static FFatResult is_inside_directory(FFat32* f, uint32_t dir_cluster, uint32_t ancestor_cluster, bool* inside)
+{
+    uint32_t depth = 0;
+    
+    while (dir_cluster != f->reg.root_dir_cluster) {
+        if (dir_cluster == ancestor_cluster) {
+            *inside = true;
+            return F_OK;
+        }
+        if (!fat_is_valid_cluster(f, dir_cluster) || ++depth > f->reg.total_clusters)
+            return F_FAT_CORRUPTED;
+        
+        TRY_IO(load_data_cluster(f, dir_cluster, 0))
+        dir_cluster = (from_16(f->buffer, DIR_ENTRY_SZ + DIR_CLUSTER_LOW)
+                | ((uint32_t) from_16(f->buffer, DIR_ENTRY_SZ + DIR_CLUSTER_HIGH) << 16)) & FAT_ENTRY_MASK;   // '..'
+        if (dir_cluster == 0)
+            dir_cluster = f->reg.root_dir_cluster;
+    }
+    
+    *inside = (ancestor_cluster == f->reg.root_dir_cluster);
+    return F_OK;
+}
+
+// Find the first cluster of a directory.
+static FFatResult find_directory(FFat32* f, const char* path, uint32_t* dir_cluster)
+{
+    FPathLocation path_location;
+    RETURN_UNLESS_F_OK(find_path_location(f, path, &path_location))
+    if (path_location.parent_dir_cluster != 0 && !(f->buffer[path_location.file_entry_in_parent_dir + DIR_ATTR] & ATTR_DIR))
+        return F_NOT_A_DIRECTORY;
+    *dir_cluster = path_location.data_cluster;
+    return F_OK;
+}
+
+// Move a directory entry to another directory, with a new name. Only the metadata is changed: the new entry is written
+// first, then the old one is marked as removed, and then the '..' of a moved directory points to its new parent.
+static FFatResult move_file(FFat32* f, FPathLocation const* from, uint32_t from_dir_cluster, char const filename[FILENAME_SZ],
+                            uint32_t to_dir_cluster)
+{
+    negative_cache_forget(f, to_dir_cluster, filename);
+    TRY_IO(load_data_cluster(f, from->parent_dir_cluster, from->parent_dir_sector))
+    
+    // rename in the same directory: the entry is changed in place
+    if (from_dir_cluster == to_dir_cluster) {
+        memcpy(&f->buffer[from->file_entry_in_parent_dir + DIR_FILENAME], filename, FILENAME_SZ);
+        TRY_IO(write_data_cluster(f, from->parent_dir_cluster, from->parent_dir_sector))
+        return F_OK;
+    }
+    
+    FDirEntry dir_entry;
+    memcpy(&dir_entry, &f->buffer[from->file_entry_in_parent_dir], sizeof(FDirEntry));
+    memcpy(dir_entry.name, filename, FILENAME_SZ);
+    
+    // create the new entry
+    FileEntry file_entry;
+    RETURN_UNLESS_F_OK(find_or_append_directory_entry(f, to_dir_cluster, &file_entry))
+    memcpy(&f->buffer[file_entry.entry_ptr], &dir_entry, sizeof(FDirEntry));
+    TRY_IO(write_data_cluster(f, file_entry.cluster, file_entry.sector))
+    
+    // remove the old entry
+    RETURN_UNLESS_F_OK(mark_file_entry_as_removed(f, from))
+    
+    // a moved directory points to its new parent
+    if (dir_entry.attrib & ATTR_DIR) {
+        TRY_IO(load_data_cluster(f, from->data_cluster, 0))
+        set_entry_cluster(f, DIR_ENTRY_SZ, to_dir_cluster == f->reg.root_dir_cluster ? 0 : to_dir_cluster);
+        TRY_IO(write_data_cluster(f, from->data_cluster, 0))
+    }
+    
+    return F_OK;
+}
+
+#endif
+
+// endregion
+
+/*********************/
+/*  DEFRAGMENTATION  */
+/*********************/
+
+// region ...
+
+#if !defined(__AVR__)   // host only, for now
+
+// Find a run of `cluster_count` contiguous free clusters, with the same next-fit policy as fat_find_free_cluster: the
+// scan starts at the FSINFO hint and wraps around to the first cluster (a run doesn't wrap around the end of the volume).
+static FFatResult fat_find_free_extent(FFat32* f, uint32_t cluster_count, uint32_t* first_cluster)
+{
     FSInfo fs_info;
     RETURN_UNLESS_F_OK(fsinfo_get(f, &fs_info))
-    fs_info.next_free_cluster = path_location->data_cluster;
-    fs_info.free_cluster_count -= cluster_count;
-    RETURN_UNLESS_F_OK(fsinfo_update(f, &fs_info))
+    
+    uint32_t start_cluster = fat_is_valid_cluster(f, fs_info.next_free_cluster) ? fs_info.next_free_cluster : 2;
+    uint32_t last_cluster = f->reg.total_clusters + 1;
+    
+    uint32_t run_start = 0, run_length = 0;
+    int64_t last_fat_sector_loaded = -1;
+    uint32_t cluster = start_cluster;
+    
+    do {
+        uint32_t fat_sector = cluster / FAT_ENTRIES_PER_SECTOR;
+        if (fat_sector != last_fat_sector_loaded) {
+            TRY_IO(load_sector(f, f->reg.fat_sector_start + fat_sector))
+            last_fat_sector_loaded = fat_sector;
+        }
+        
+        if (fat_entry_type(f, from_32(f->buffer, (cluster % FAT_ENTRIES_PER_SECTOR) * 4)) != FAT_ENTRY_FREE) {
+            run_length = 0;
+        } else {
+            if (run_length++ == 0)
+                run_start = cluster;
+            if (run_length == cluster_count) {
+                *first_cluster = run_start;
+                return F_OK;
+            }
+        }
+        
+        if (cluster == last_cluster) {
+            cluster = 2;
+            run_length = 0;
+        } else {
+            ++cluster;
+        }
+    } while (cluster != start_cluster);
+    
+    return F_DEVICE_FULL;
+}
+
+// Link the clusters `first_cluster` .. `first_cluster + cluster_count - 1` in a chain, one FAT sector at a time.
+static FFatResult fat_write_contiguous_chain(FFat32* f, uint32_t first_cluster, uint32_t cluster_count)
+{
+    uint32_t last_cluster = first_cluster + cluster_count - 1;
+    uint32_t cluster = first_cluster;
+    
+    while (cluster <= last_cluster) {
+        uint32_t fat_sector = cluster / FAT_ENTRIES_PER_SECTOR;
+        TRY_IO(load_sector(f, f->reg.fat_sector_start + fat_sector))
+        for (; cluster <= last_cluster && cluster / FAT_ENTRIES_PER_SECTOR == fat_sector; ++cluster)
+            fat_set_entry(f, cluster, cluster == last_cluster ? FAT_EOF : cluster + 1);
+        RETURN_UNLESS_F_OK(fat_write_sector(f, fat_sector))
+    }
     
     return F_OK;
 }
 
+// Point the '.' entry of a relocated directory, and the '..' entries of its subdirectories, to its new first cluster.
+static FFatResult update_directory_links(FFat32* f, uint32_t dir_cluster)
+{
+    TRY_IO(load_data_cluster(f, dir_cluster, 0))
+    set_entry_cluster(f, 0, dir_cluster);   // '.'
+    TRY_IO(write_data_cluster(f, dir_cluster, 0))
+    
+    FFatResult result;
+    FDirResult dir_result = { .next_cluster = dir_cluster };
+    FContinuation continuation = F_START_OVER;
+    
+    do {   // each iteration looks to one sector in the directory
+        uint32_t cluster = dir_result.next_cluster;
+        uint16_t sector = dir_result.next_sector;
+        
+        result = dir(f, dir_cluster, continuation, &dir_result);
+        if (result != F_OK && result != F_MORE_DATA)
+            return result;
+        
+        for (uint16_t entry_ptr = 0; entry_ptr < BYTES_PER_SECTOR; entry_ptr += DIR_ENTRY_SZ) {
+            uint8_t first_chr = f->buffer[entry_ptr + DIR_FILENAME];
+            if (first_chr == DIR_ENTRY_FREE)
+                break;
+            if (first_chr == DIR_ENTRY_UNUSED || first_chr == '.' || !(f->buffer[entry_ptr + DIR_ATTR] & ATTR_DIR))
+                continue;
+            
+            // subdirectory: update its '..' (second entry), then reload this directory sector
+            uint32_t child_cluster = (from_16(f->buffer, entry_ptr + DIR_CLUSTER_LOW)
+                    | ((uint32_t) from_16(f->buffer, entry_ptr + DIR_CLUSTER_HIGH) << 16)) & FAT_ENTRY_MASK;
+            if (!fat_is_valid_cluster(f, child_cluster))
+                return F_FAT_CORRUPTED;
+            TRY_IO(load_data_cluster(f, child_cluster, 0))
+            set_entry_cluster(f, DIR_ENTRY_SZ, dir_cluster);
+            TRY_IO(write_data_cluster(f, child_cluster, 0))
+            TRY_IO(load_data_cluster(f, cluster, sector))
+        }
+        
+        continuation = F_CONTINUE;
+        
+    } while (result == F_MORE_DATA);
+    
+    return F_OK;
+}
+
+// Move the chain of a file or directory to the next free extent large enough to hold it. The data is copied first,
+// then the new chain is written and the entry in the parent directory points to it; only then the old chain is freed.
+static FFatResult defrag_file(FFat32* f, FPathLocation const* path_location, bool is_directory)
+{
+    if (path_location->data_cluster == 0)   // empty file: no chain
+        return F_OK;
+    
+    // count clusters and check if the chain is already contiguous
+    uint32_t cluster_count = 0, count = 0;
+    bool contiguous = true;
+    for (uint32_t cluster = path_location->data_cluster; cluster != FAT_EOF; ) {
+        uint32_t next_cluster;
+        RETURN_UNLESS_F_OK(fat_next_cluster(f, cluster, &next_cluster, &count))
+        if (next_cluster != FAT_EOF && next_cluster != cluster + 1)
+            contiguous = false;
+        ++cluster_count;
+        cluster = next_cluster;
+    }
+    if (contiguous)
+        return F_OK;
+    
+    uint32_t new_cluster;
+    RETURN_UNLESS_F_OK(fat_find_free_extent(f, cluster_count, &new_cluster))
+    
+    // copy data, cluster by cluster
+    count = 0;
+    uint32_t cluster = path_location->data_cluster;
+    for (uint32_t i = 0; i < cluster_count; ++i) {
+        uint32_t next_cluster;
+        RETURN_UNLESS_F_OK(fat_next_cluster(f, cluster, &next_cluster, &count))
+        for (uint16_t sector = 0; sector < f->reg.sectors_per_cluster; ++sector) {
+            TRY_IO(load_data_cluster(f, cluster, sector))
+            TRY_IO(write_data_cluster(f, new_cluster + i, sector))
+        }
+        cluster = next_cluster;
+    }
+    
+    // write the new chain, and point the entry in the parent directory to it
+    RETURN_UNLESS_F_OK(fat_write_contiguous_chain(f, new_cluster, cluster_count))
+    negative_cache_forget(f, new_cluster, NULL);
+    TRY_IO(load_data_cluster(f, path_location->parent_dir_cluster, path_location->parent_dir_sector))
+    set_entry_cluster(f, path_location->file_entry_in_parent_dir, new_cluster);
+    TRY_IO(write_data_cluster(f, path_location->parent_dir_cluster, path_location->parent_dir_sector))
+    
+    if (is_directory) {
+        RETURN_UNLESS_F_OK(update_directory_links(f, new_cluster))
+        if (f->reg.current_dir_cluster == path_location->data_cluster)
+            f->reg.current_dir_cluster = new_cluster;
+    }
+    
+    // free the old chain, and move the next free cluster hint after the new one (the number of free clusters doesn't
+    // change)
+    RETURN_UNLESS_F_OK(fat_remove_file(f, path_location->data_cluster, &count))
+    return update_fsinfo(f, new_cluster + cluster_count - 1, 0);
+}
+
+#endif
+
 // endregion
 
 /********************/
@@ -747,6 +1914,9 @@ static FFatResult remove_file(FFat32* f, FPathLocation const* path_location)
 
 static FFatResult f_init(FFat32* f)
 {
+    negative_cache_forget(f, 0, NULL);   // the volume might have been changed (or replaced) since the last lookups
+    f->reg.recalc_next_free_cluster = 0;   // no FSINFO recalculation in progress
+    
     // check partition location
     if (!f->read(MBR_SECTOR, f->buffer, f->data))
         return F_IO_ERROR;
@@ -778,9 +1948,14 @@ static FFatResult f_init(FFat32* f)
     // check if it is FAT32
     uint16_t total_sectors_16 = from_16(f->buffer, BPB_TOTAL_SECTORS_16);
     uint32_t total_sectors_32 = from_32(f->buffer, BPB_TOTAL_SECTORS);
-    if (total_sectors_16 != 0 || total_sectors_32 == 0)
+    if (total_sectors_16 != 0 || total_sectors_32 <= root_dir_sector)
         return F_NOT_FAT_32;
     
+    // number of data clusters (limited by what fits in the FAT, in case the boot sector is inconsistent)
+    f->reg.total_clusters = (total_sectors_32 - root_dir_sector) / f->reg.sectors_per_cluster;
+    if (f->reg.total_clusters > f->reg.fat_size_sectors * FAT_ENTRIES_PER_SECTOR - 2)
+        f->reg.total_clusters = f->reg.fat_size_sectors * FAT_ENTRIES_PER_SECTOR - 2;
+    
     // find root directory
     uint32_t root_dir_cluster_ptr = from_32(f->buffer, BPB_ROOT_DIR_CLUSTER);
     f->reg.root_dir_cluster = root_dir_cluster_ptr;
@@ -801,6 +1976,41 @@ static FFatResult f_fsinfo_recalc(FFat32* f)
 {
     FSInfo fs_info;
     RETURN_UNLESS_F_OK(fsinfo_recalculate(f, &fs_info))
+    to_32(f->buffer, 0, fs_info.free_cluster_count);
+    return F_OK;
+}
+
+// Recalculate FSINFO a few FAT sectors at a time, so it can be spread over idle time. The position and the partial
+// results are kept in the registers between calls; FSINFO is only written in the last call.
+static FFatResult f_fsinfo_recalc_step(FFat32* f)
+{
+    if (f->buffer[0] == F_START_OVER)
+        fsinfo_recalc_start_over(f);
+    else if (f->reg.recalc_next_free_cluster == 0)
+        return F_INCORRECT_OPERATION;   // no recalculation in progress
+    
+    uint32_t sectors_in_use = fsinfo_fat_sectors_in_use(f);
+    uint32_t sector_count = f->buffer[1] ? f->buffer[1] : 1;
+    if (f->reg.recalc_next_fat_sector >= sectors_in_use)
+        sector_count = 0;
+    else if (sector_count > sectors_in_use - f->reg.recalc_next_fat_sector)
+        sector_count = sectors_in_use - f->reg.recalc_next_fat_sector;
+    
+    FSInfo fs_info = {
+            .next_free_cluster  = f->reg.recalc_next_free_cluster,
+            .free_cluster_count = f->reg.recalc_free_cluster_count,
+    };
+    RETURN_UNLESS_F_OK(fsinfo_count_free_clusters(f, f->reg.recalc_next_fat_sector, sector_count, &fs_info))
+    f->reg.recalc_next_fat_sector += sector_count;
+    f->reg.recalc_next_free_cluster = fs_info.next_free_cluster;
+    f->reg.recalc_free_cluster_count = fs_info.free_cluster_count;
+    
+    if (f->reg.recalc_next_fat_sector < sectors_in_use)
+        return F_MORE_DATA;
+    
+    f->reg.recalc_next_free_cluster = 0;
+    RETURN_UNLESS_F_OK(fsinfo_set(f, &fs_info))
+    to_32(f->buffer, 0, fs_info.free_cluster_count);
     return F_OK;
 }
 
@@ -809,10 +2019,9 @@ static FFatResult f_free(FFat32* f)
     TRY_IO(load_sector(f, FSINFO_SECTOR))
     uint32_t free_ = from_32(f->buffer, FSI_FREE_COUNT);
     if (free_ == 0xffffffff)
-        f_fsinfo_recalc(f);
-    else
-        to_32(f->buffer, 0, free_);
+        return f_fsinfo_recalc(f);
     
+    to_32(f->buffer, 0, free_);
     return F_OK;
 }
 
@@ -834,13 +2043,13 @@ static FFatResult is_directory_empty(FFat32* f, FPathLocation const* path_locati
 {
     uint32_t count = 0;
     FFatResult result;
-    FDirResult dir_result = { 0, 0 };
+    FDirResult dir_result = { 0 };
     FContinuation continuation = F_START_OVER;
     
     do {   // each iteration looks to one sector in the cluster
         
         // read directory
-        result = dir(f, path_location->data_cluster, continuation, dir_result.next_cluster, dir_result.next_sector, &dir_result);
+        result = dir(f, path_location->data_cluster, continuation, &dir_result);
         if (result != F_OK && result != F_MORE_DATA)
             return result;
         
@@ -866,14 +2075,182 @@ static FFatResult is_directory_empty(FFat32* f, FPathLocation const* path_locati
 
 static FFatResult f_dir(FFat32* f)
 {
-    FDirResult dir_result;
-    FFatResult result = dir(f, f->reg.current_dir_cluster, f->buffer[0],
-                            f->reg.state_next_cluster, f->reg.state_next_sector, &dir_result);
+    FDirResult dir_result = {
+            .next_cluster     = f->reg.state_next_cluster,
+            .next_sector      = f->reg.state_next_sector,
+            .cluster_count    = f->reg.state_cluster_count,
+            .run_last_cluster = f->reg.state_run_last_cluster,
+            .run_next_cluster = f->reg.state_run_next_cluster,
+    };
+    FFatResult result = dir(f, f->reg.current_dir_cluster, f->buffer[0], &dir_result);
     f->reg.state_next_cluster = dir_result.next_cluster;
     f->reg.state_next_sector = dir_result.next_sector;
+    f->reg.state_cluster_count = dir_result.cluster_count;
+    f->reg.state_run_last_cluster = dir_result.run_last_cluster;
+    f->reg.state_run_next_cluster = dir_result.run_next_cluster;
     return result;
 }
 
+#if !defined(__AVR__)   // host only: doesn't fit in the AVR code size budget
+
+// Check if a directory entry is a file or directory to be listed (not removed, a long filename or a volume label).
+static bool is_listed_entry(FDirEntry const* entry)
+{
+    return (uint8_t) entry->name[0] != DIR_ENTRY_UNUSED && (entry->attrib & ATTR_LFN) != ATTR_LFN
+            && !(entry->attrib & ATTR_VOLUME_ID);
+}
+
+static void set_dir_info(FFat32* f, FFatDirInfo* info, FDirEntry const* entry)
+{
+    format_filename(info->name, entry->name);
+    info->attrib = entry->attrib;
+    info->cluster = (entry->cluster_low | ((uint32_t) entry->cluster_high << 16)) & FAT_ENTRY_MASK;
+    if (info->cluster == 0 && (entry->attrib & ATTR_DIR))   // '..' pointing to the root directory
+        info->cluster = f->reg.root_dir_cluster;
+    info->size = entry->file_size;
+    info->wrt_datetime = entry->wrt_datetime;
+}
+
+// List the current directory as parsed entries: like F_DIR, one directory sector is read per call, but only its files
+// and directories are returned (removed, long filename and volume label entries are skipped), as a count followed by
+// FFatDirInfo records. A call can return no entries, if the sector only had entries that were skipped.
+static FFatResult f_dirinfo(FFat32* f)
+{
+    FFatResult result = f_dir(f);
+    if (result != F_OK && result != F_MORE_DATA)
+        return result;
+    
+    // the records are smaller than the entries, so they are written over the entries that were already parsed
+    uint8_t count = 0;
+    for (uint16_t entry_ptr = 0; entry_ptr < BYTES_PER_SECTOR; entry_ptr += DIR_ENTRY_SZ) {
+        FDirEntry entry;
+        memcpy(&entry, &f->buffer[entry_ptr], sizeof entry);
+        if ((uint8_t) entry.name[0] == DIR_ENTRY_FREE)
+            break;
+        if (is_listed_entry(&entry))
+            set_dir_info(f, (FFatDirInfo *) &f->buffer[1 + count++ * sizeof(FFatDirInfo)], &entry);
+    }
+    
+    f->buffer[0] = count;
+    uint16_t end = 1 + count * sizeof(FFatDirInfo);
+    memset(&f->buffer[end], 0, BYTES_PER_SECTOR - end);
+    return result;
+}
+
+#define MAX_FIND_MATCHES (MAX_FILE_PATH / sizeof(FFatDirInfo))   /* = 9, kept in global_file_path */
+
+// Convert a pattern ("*.TXT", "F??.*") to FAT format: each '*' is expanded to '?' up to the end of the name or of the
+// extension. A pattern without extension that ends in '*' also matches any extension, as in FatFs.
+static void parse_pattern(char result[FILENAME_SZ], char const* pattern)
+{
+    memset(result, ' ', FILENAME_SZ);
+    
+    uint8_t pos = 0, end = 8;
+    char last = '\0';
+    for (; *pattern; last = *pattern++) {
+        if (*pattern == '.' && end == 8) {
+            pos = 8;
+            end = FILENAME_SZ;
+        } else if (*pattern == '*') {
+            while (pos < end)
+                result[pos++] = '?';
+        } else if (pos < end) {
+            result[pos++] = *pattern;
+        }
+    }
+    
+    if (end == 8 && last == '*')
+        memset(&result[8], '?', 3);
+}
+
+static bool matches_pattern(char const pattern[FILENAME_SZ], char const filename[FILENAME_SZ])
+{
+    for (uint8_t i = 0; i < FILENAME_SZ; ++i)
+        if (pattern[i] != '?' && pattern[i] != filename[i])
+            return false;
+    return true;
+}
+
+// Find the entries of a directory that match a pattern. With F_START_OVER, the input is a path whose last component is
+// the pattern ("/DIR/*.TXT"); each call with F_CONTINUE resumes the search where the previous one stopped. The entries
+// are matched while each sector is scanned, and only the matches are returned, like in F_DIRINFO: a count followed by
+// up to 9 FFatDirInfo records. It returns F_MORE_DATA if the search stopped because there were more matches than fit.
+static FFatResult f_find(FFat32* f)
+{
+    if (f->buffer[0] == F_START_OVER) {
+        char* path = (char *) &f->buffer[1];
+        if (memchr(path, '\0', BYTES_PER_SECTOR - 1) == NULL)
+            return F_FILE_PATH_TOO_LONG;
+        
+        // split the pattern from the directory path
+        char* slash = strrchr(path, '/');
+        parse_pattern(f->reg.state_find_pattern, slash ? slash + 1 : path);
+        if (slash == path)   // the directory is the root
+            ++slash;
+        *(slash ? slash : path) = '\0';
+        
+        uint32_t dir_cluster;
+        RETURN_UNLESS_F_OK(find_directory(f, path, &dir_cluster))
+        f->reg.state_next_cluster = dir_cluster;
+        f->reg.state_next_sector = 0;
+        f->reg.state_cluster_count = 0;
+        f->reg.state_run_last_cluster = 0;
+        f->reg.state_next_entry = 0;
+    } else if (!fat_is_valid_cluster(f, f->reg.state_next_cluster)) {
+        return F_INCORRECT_OPERATION;   // no search in progress
+    }
+    
+    FFatDirInfo* matches = (FFatDirInfo *) global_file_path;
+    uint8_t count = 0;
+    FFatResult result;
+    
+    do {   // each iteration scans one directory sector
+        FDirResult dir_result = {
+                .next_cluster     = f->reg.state_next_cluster,
+                .next_sector      = f->reg.state_next_sector,
+                .cluster_count    = f->reg.state_cluster_count,
+                .run_last_cluster = f->reg.state_run_last_cluster,
+                .run_next_cluster = f->reg.state_run_next_cluster,
+        };
+        result = dir(f, 0, F_CONTINUE, &dir_result);
+        if (result != F_OK && result != F_MORE_DATA)
+            return result;
+        
+        uint16_t entry_ptr = f->reg.state_next_entry * DIR_ENTRY_SZ;
+        for (; entry_ptr < BYTES_PER_SECTOR && count < MAX_FIND_MATCHES; entry_ptr += DIR_ENTRY_SZ) {
+            FDirEntry const* entry = (FDirEntry const *) &f->buffer[entry_ptr];
+            if ((uint8_t) entry->name[0] == DIR_ENTRY_FREE) {
+                entry_ptr = BYTES_PER_SECTOR;
+                break;
+            }
+            if (is_listed_entry(entry) && entry->name[0] != '.' && matches_pattern(f->reg.state_find_pattern, entry->name))
+                set_dir_info(f, &matches[count++], entry);
+        }
+        
+        if (entry_ptr < BYTES_PER_SECTOR) {   // no space for more matches: the next call starts at this entry
+            f->reg.state_next_entry = entry_ptr / DIR_ENTRY_SZ;
+            result = F_MORE_DATA;
+            break;
+        }
+        
+        f->reg.state_next_cluster = dir_result.next_cluster;
+        f->reg.state_next_sector = dir_result.next_sector;
+        f->reg.state_cluster_count = dir_result.cluster_count;
+        f->reg.state_run_last_cluster = dir_result.run_last_cluster;
+        f->reg.state_run_next_cluster = dir_result.run_next_cluster;
+        f->reg.state_next_entry = 0;
+        
+    } while (result == F_MORE_DATA);
+    
+    f->buffer[0] = count;
+    memcpy(&f->buffer[1], matches, count * sizeof(FFatDirInfo));
+    uint16_t end = 1 + count * sizeof(FFatDirInfo);
+    memset(&f->buffer[end], 0, BYTES_PER_SECTOR - end);
+    return result;
+}
+
+#endif
+
 static FFatResult f_cd(FFat32* f)
 {
     FPathLocation path_location;
@@ -884,27 +2261,76 @@ static FFatResult f_cd(FFat32* f)
 
 static FFatResult f_mkdir(FFat32* f, uint32_t fat_datetime)
 {
-    uint32_t parent_dir_cluster = 0;
+    // parse filename and find parent directory cluster
+    char filename[FILENAME_SZ];
+    split_path_and_filename((char *) f->buffer, filename);
+    FPathLocation path_location;
+    RETURN_UNLESS_F_OK(find_path_location(f, (const char *) f->buffer, &path_location))
     
-    // create file entry
-    uint32_t cluster_self;
-    RETURN_UNLESS_F_OK(create_file_entry(f, (char *) f->buffer, ATTR_DIR, fat_datetime, &cluster_self, &parent_dir_cluster))
+    uint32_t dir_cluster;
+    return create_directory(f, path_location.data_cluster, filename, fat_datetime, &dir_cluster);
+}
+
+#if !defined(__AVR__)
+
+// Create a directory and the missing directories in its path, walking the path once: each component is looked up in the
+// directory found (or created) for the previous one.
+static FFatResult f_mkdir_p(FFat32* f, uint32_t fat_datetime)
+{
+    size_t len = strlen((const char *) f->buffer);
+    if (len >= MAX_FILE_PATH)
+        return F_FILE_PATH_TOO_LONG;
+    memcpy(global_file_path, f->buffer, len + 1);
+    char* component = global_file_path;
+    
+    // find starting cluster
+    uint32_t dir_cluster = f->reg.current_dir_cluster;
+    if (*component == '/') {   // absolute path
+        dir_cluster = f->reg.root_dir_cluster;
+        ++component;
+    }
     
-    // create empty directory structure ('.' and '..')
-    char filename[FILENAME_SZ]; memset(filename, ' ', FILENAME_SZ);
-    filename[0] = '.';
-    RETURN_UNLESS_F_OK(create_entry_in_directory(f, cluster_self, filename, ATTR_DIR, fat_datetime, cluster_self))
-    filename[1] = '.';
-    RETURN_UNLESS_F_OK(create_entry_in_directory(f, cluster_self, filename, ATTR_DIR, fat_datetime, parent_dir_cluster))
+    bool created = false;   // after a directory is created, the next components can't exist
+    
+    while (*component) {   // each iteration finds or creates one directory
+        char* end = strchr(component, '/');
+        size_t component_len = end ? (size_t) (end - component) : strlen(component);
+        
+        if (component_len > 0) {   // skip repeated or trailing slashes
+            char filename[FILENAME_SZ];
+            parse_filename(filename, component, component_len);
+            
+            FPathLocation path_location;
+            FFatResult result = created ? F_PATH_NOT_FOUND : find_parsed_file_in_dir(f, filename, dir_cluster, &path_location);
+            if (result == F_OK) {
+                if (!(f->buffer[path_location.file_entry_in_parent_dir + DIR_ATTR] & ATTR_DIR))
+                    return F_NOT_A_DIRECTORY;
+                dir_cluster = path_location.data_cluster;
+            } else if (result == F_PATH_NOT_FOUND) {
+                RETURN_UNLESS_F_OK(create_directory(f, dir_cluster, filename, fat_datetime, &dir_cluster))
+                created = true;
+            } else {
+                return result;
+            }
+        }
+        
+        if (end == NULL)
+            break;
+        component = end + 1;
+    }
     
     return F_OK;
 }
 
+#endif
+
 static FFatResult f_rmdir(FFat32* f)
 {
     // find directory
     FPathLocation path_location;
     RETURN_UNLESS_F_OK(find_path_location(f, (const char *) f->buffer, &path_location))
+    if (path_location.parent_dir_cluster == 0)   // root or current directory: there's no entry to remove
+        return F_INVALID_FILENAME;
     
     // check if "file" is directory
     uint8_t attr = f->buffer[path_location.file_entry_in_parent_dir + DIR_ATTR];    // buffer already contains the dir entry
@@ -916,11 +2342,72 @@ static FFatResult f_rmdir(FFat32* f)
     RETURN_UNLESS_F_OK(is_directory_empty(f, &path_location, &is_empty))
     
     // remove directory "file"
-    RETURN_UNLESS_F_OK(remove_file(f, &path_location))
+    RETURN_UNLESS_F_OK(remove_file(f, &path_location, 0))
     
     return F_OK;
 }
 
+#if !defined(__AVR__)
+
+static FFatResult f_rmtree(FFat32* f)
+{
+    // find directory
+    FPathLocation path_location;
+    RETURN_UNLESS_F_OK(find_path_location(f, (const char *) f->buffer, &path_location))
+    if (path_location.parent_dir_cluster == 0)   // root or current directory: there's no entry to remove
+        return F_INVALID_FILENAME;
+    if (f->buffer[path_location.file_entry_in_parent_dir + DIR_FILENAME] == '.')   // '.' and '..'
+        return F_INVALID_FILENAME;
+    
+    // check if "file" is directory
+    uint8_t attr = f->buffer[path_location.file_entry_in_parent_dir + DIR_ATTR];    // buffer already contains the dir entry
+    if (!(attr & ATTR_DIR))
+        return F_NOT_A_DIRECTORY;
+    
+    // if the current directory is being removed, go back to the root directory
+    bool inside;
+    RETURN_UNLESS_F_OK(is_inside_directory(f, f->reg.current_dir_cluster, path_location.data_cluster, &inside))
+    if (inside)
+        f->reg.current_dir_cluster = f->reg.root_dir_cluster;
+    
+    // remove the contents, then the directory itself (FSINFO is updated once, with all the clusters freed); a corrupted
+    // chain inside the tree doesn't stop the removal, but it's reported at the end
+    uint32_t freed_clusters;
+    FFatResult result = remove_directory_contents(f, path_location.data_cluster, &freed_clusters);
+    if (result != F_OK && result != F_FAT_CORRUPTED) {
+        if (freed_clusters > 0)
+            RETURN_UNLESS_F_OK(update_fsinfo(f, 0, +(int64_t) freed_clusters))
+        return result;
+    }
+    
+    RETURN_UNLESS_F_OK(remove_file(f, &path_location, freed_clusters))
+    return result;
+}
+
+static FFatResult f_compact(FFat32* f)
+{
+    uint32_t dir_cluster;
+    RETURN_UNLESS_F_OK(find_directory(f, (const char *) f->buffer, &dir_cluster))
+    
+    // the entries are moved, so a listing in progress can't be continued, and the next F_MKFILES batch in this directory
+    // looks for free entries from its start (the clusters after the entries might be freed)
+    f->reg.state_next_cluster = 0;
+    f->reg.state_next_sector = 0;
+    if (f->reg.mkfiles_dir_cluster == dir_cluster) {
+        f->reg.mkfiles_next_cluster = dir_cluster;
+        f->reg.mkfiles_next_sector = 0;
+        f->reg.mkfiles_cluster_count = 0;
+    }
+    
+    uint32_t freed_clusters;
+    FFatResult result = compact_directory(f, dir_cluster, &freed_clusters);
+    if (freed_clusters > 0)
+        RETURN_UNLESS_F_OK(update_fsinfo(f, 0, +(int64_t) freed_clusters))
+    return result;
+}
+
+#endif
+
 // endregion
 
 /************************/
@@ -929,6 +2416,103 @@ static FFatResult f_rmdir(FFat32* f)
 
 // region ...
 
+#if !defined(__AVR__)
+
+// Create up to MAX_BATCH_FILES files in a directory: the clusters of all files are found in one scan of the FAT and
+// linked in one pass, the directory entries are written sector by sector, and FSINFO is written once. On a fragmented
+// volume, where a contiguous run can't be found for each file, the clusters are allocated one by one. With F_START_OVER
+// the directory is only opened, and each call with F_CONTINUE adds files after the ones created in the previous call.
+// If a name is repeated, or already in use in the directory, nothing is created and F_FILE_EXISTS is returned. The
+// directory and the position are kept in the `mkfiles_` registers, so a listing in progress is not affected.
+static FFatResult f_mkfiles(FFat32* f, uint32_t fat_datetime)
+{
+    if (f->buffer[0] == F_START_OVER) {   // open directory
+        FPathLocation path_location;
+        RETURN_UNLESS_F_OK(find_path_location(f, (const char *) &f->buffer[1], &path_location))
+        if (path_location.parent_dir_cluster != 0 && !(f->buffer[path_location.file_entry_in_parent_dir + DIR_ATTR] & ATTR_DIR))
+            return F_NOT_A_DIRECTORY;
+        f->reg.mkfiles_dir_cluster = path_location.data_cluster;
+        f->reg.mkfiles_next_cluster = path_location.data_cluster;
+        f->reg.mkfiles_next_sector = 0;
+        f->reg.mkfiles_cluster_count = 0;
+        return F_OK;
+    }
+    
+    if (!fat_is_valid_cluster(f, f->reg.mkfiles_next_cluster) || f->reg.mkfiles_next_sector >= f->reg.sectors_per_cluster
+            || !fat_is_valid_cluster(f, f->reg.mkfiles_dir_cluster))
+        return F_INCORRECT_OPERATION;   // directory was not opened
+    
+    // parse the list of files (name, NUL, 4-byte size), ending with an empty name
+    FBatchFile* files = (FBatchFile *) global_file_path;
+    uint8_t file_count = 0;
+    uint16_t pos = 1;
+    while (pos < BYTES_PER_SECTOR && f->buffer[pos] != '\0') {
+        uint8_t const* end = memchr(&f->buffer[pos], '\0', BYTES_PER_SECTOR - pos);
+        if (end == NULL || end - f->buffer + 5 > BYTES_PER_SECTOR)
+            return F_INVALID_FILENAME;
+        if (file_count == MAX_BATCH_FILES)
+            return F_FILE_PATH_TOO_LONG;
+        
+        FBatchFile* file = &files[file_count++];
+        parse_filename(file->name, (const char *) &f->buffer[pos], end - &f->buffer[pos]);
+        if (!validate_filename(file->name))
+            return F_INVALID_FILENAME;
+        file->size = from_32(f->buffer, end - f->buffer + 1);
+        pos = end - f->buffer + 5;
+    }
+    if (file_count == 0)
+        return F_OK;
+    RETURN_UNLESS_F_OK(check_batch_names(f, f->reg.mkfiles_dir_cluster, files, file_count))
+    
+    // allocate clusters (only the FAT is changed until the directory entries are written): a contiguous run for each
+    // file if possible, otherwise cluster by cluster
+    uint32_t allocated = 0, last_allocated_cluster = 0;
+    FFatResult result = fat_find_free_runs(f, files, file_count);
+    if (result == F_DEVICE_FULL) {
+        RETURN_UNLESS_F_OK(fat_allocate_scattered(f, files, file_count))   // (FSINFO is already updated)
+    } else {
+        RETURN_UNLESS_F_OK(result)
+        RETURN_UNLESS_F_OK(fat_link_runs(f, files, file_count))
+        for (uint8_t i = 0; i < file_count; ++i) {
+            uint32_t cluster_count = batch_file_clusters(f, &files[i]);
+            for (uint32_t j = 0; j < cluster_count; ++j)
+                TRY_IO(zero_data_cluster(f, files[i].cluster + j, 0))
+            if (cluster_count > 0)
+                last_allocated_cluster = files[i].cluster + cluster_count - 1;
+            allocated += cluster_count;
+        }
+    }
+    
+    // create directory entries, and update FSINFO
+    RETURN_UNLESS_F_OK(create_batch_entries(f, files, file_count, fat_datetime))
+    if (allocated > 0)
+        RETURN_UNLESS_F_OK(update_fsinfo(f, last_allocated_cluster, -(int64_t) allocated))
+    
+    return F_OK;
+}
+
+#endif
+
+static FFatResult f_rm(FFat32* f)
+{
+    // find file
+    FPathLocation path_location;
+    RETURN_UNLESS_F_OK(find_path_location(f, (const char *) f->buffer, &path_location))
+    if (path_location.parent_dir_cluster == 0)   // root or current directory: there's no entry to remove
+        return F_INVALID_FILENAME;
+    if (f->buffer[path_location.file_entry_in_parent_dir + DIR_FILENAME] == '.')   // '.' and '..'
+        return F_INVALID_FILENAME;
+    
+    // a directory can only be removed if empty
+    uint8_t attr = f->buffer[path_location.file_entry_in_parent_dir + DIR_ATTR];    // buffer already contains the entry
+    if (attr & ATTR_DIR) {
+        bool is_empty;
+        RETURN_UNLESS_F_OK(is_directory_empty(f, &path_location, &is_empty))
+    }
+    
+    return remove_file(f, &path_location, 0);
+}
+
 static FFatResult f_stat(FFat32* f)
 {
     FPathLocation path_location;
@@ -936,8 +2520,12 @@ static FFatResult f_stat(FFat32* f)
     
     // set first 32 bits to file stat
     uint16_t addr = path_location.file_entry_in_parent_dir;
-    if (addr != 0)
+    if (path_location.parent_dir_cluster == 0) {   // root or current directory: only the directory attribute is set
+        memset(f->buffer, 0, DIR_ENTRY_SZ);
+        f->buffer[DIR_ATTR] = ATTR_DIR;
+    } else if (addr != 0) {
         memcpy(f->buffer, &f->buffer[addr], DIR_ENTRY_SZ);
+    }
     
     // the rest of the bits are zeroed
     memset(&f->buffer[DIR_ENTRY_SZ], 0, BYTES_PER_SECTOR - DIR_ENTRY_SZ);
@@ -945,6 +2533,69 @@ static FFatResult f_stat(FFat32* f)
     return F_OK;
 }
 
+#if !defined(__AVR__)
+
+static FFatResult f_mv(FFat32* f)
+{
+    // input is the old path and the new path; the new path is kept at the end of global_file_path while the old one is looked up
+    char* from_path = (char *) f->buffer;
+    char* from_end = memchr(from_path, '\0', BYTES_PER_SECTOR - 1);
+    char* to_end = from_end ? memchr(from_end + 1, '\0', &from_path[BYTES_PER_SECTOR] - (from_end + 1)) : NULL;
+    if (to_end == NULL || to_end - from_path + 1 > MAX_FILE_PATH)
+        return F_FILE_PATH_TOO_LONG;
+    size_t to_len = to_end - (from_end + 1);
+    char* to_path = &global_file_path[MAX_FILE_PATH - to_len - 1];
+    memcpy(to_path, from_end + 1, to_len + 1);
+    
+    // find the entry to move ('.' and '..' can't be moved)
+    char from_filename[FILENAME_SZ];
+    split_path_and_filename(from_path, from_filename);
+    uint32_t from_dir_cluster;
+    RETURN_UNLESS_F_OK(find_directory(f, from_path, &from_dir_cluster))
+    FPathLocation from;
+    RETURN_UNLESS_F_OK(find_parsed_file_in_dir(f, from_filename, from_dir_cluster, &from))
+    if (f->buffer[from.file_entry_in_parent_dir + DIR_FILENAME] == '.')
+        return F_INVALID_FILENAME;
+    bool is_directory = f->buffer[from.file_entry_in_parent_dir + DIR_ATTR] & ATTR_DIR;
+    
+    // find the destination directory, and check that the new name is not in use
+    char to_filename[FILENAME_SZ];
+    split_path_and_filename(to_path, to_filename);
+    if (!validate_filename(to_filename))
+        return F_INVALID_FILENAME;
+    uint32_t to_dir_cluster;
+    RETURN_UNLESS_F_OK(find_directory(f, to_path, &to_dir_cluster))
+    FPathLocation existing;
+    FFatResult result = find_parsed_file_in_dir(f, to_filename, to_dir_cluster, &existing);
+    if (result == F_OK)
+        return F_FILE_EXISTS;
+    if (result != F_PATH_NOT_FOUND)
+        return result;
+    
+    // a directory can't be moved inside itself
+    if (is_directory) {
+        bool inside;
+        RETURN_UNLESS_F_OK(is_inside_directory(f, to_dir_cluster, from.data_cluster, &inside))
+        if (inside)
+            return F_INVALID_FILENAME;
+    }
+    
+    return move_file(f, &from, from_dir_cluster, to_filename, to_dir_cluster);
+}
+
+static FFatResult f_defrag(FFat32* f)
+{
+    FPathLocation path_location;
+    RETURN_UNLESS_F_OK(find_path_location(f, (const char*) f->buffer, &path_location))
+    if (path_location.parent_dir_cluster == 0)   // root or current directory: the root directory can't be moved
+        return F_INVALID_FILENAME;
+    
+    uint8_t attr = f->buffer[path_location.file_entry_in_parent_dir + DIR_ATTR];    // buffer already contains the entry
+    return defrag_file(f, &path_location, attr & ATTR_DIR);
+}
+
+#endif
+
 // endregion
 
 /*****************/
@@ -957,18 +2608,34 @@ FFatResult f_fat32(FFat32* f, FFat32Op operation, uint32_t fat_datetime)
         case F_INIT:          f->reg.last_operation_result = f_init(f);   break;
         case F_FREE:          f->reg.last_operation_result = f_free(f);   break;
         case F_FSINFO_RECALC: f->reg.last_operation_result = f_fsinfo_recalc(f); break;
+        case F_FSINFO_RECALC_STEP: f->reg.last_operation_result = f_fsinfo_recalc_step(f); break;
         case F_BOOT:          f->reg.last_operation_result = f_boot(f);   break;
         case F_DIR:           f->reg.last_operation_result = f_dir(f);    break;
+#if !defined(__AVR__)
+        case F_DIRINFO:       f->reg.last_operation_result = f_dirinfo(f); break;
+        case F_FIND:          f->reg.last_operation_result = f_find(f);   break;
+#endif
         case F_CD:            f->reg.last_operation_result = f_cd(f);     break;
         case F_MKDIR:         f->reg.last_operation_result = f_mkdir(f, fat_datetime); break;
         case F_RMDIR:         f->reg.last_operation_result = f_rmdir(f);  break;
+#if !defined(__AVR__)
+        case F_RMTREE:        f->reg.last_operation_result = f_rmtree(f); break;
+        case F_MKDIR_P:       f->reg.last_operation_result = f_mkdir_p(f, fat_datetime); break;
+        case F_COMPACT:       f->reg.last_operation_result = f_compact(f); break;
+#endif
         case F_OPEN:          break;
         case F_CLOSE:         break;
         case F_READ:          break;
         case F_WRITE:         break;
+#if !defined(__AVR__)
+        case F_MKFILES:       f->reg.last_operation_result = f_mkfiles(f, fat_datetime); break;
+#endif
         case F_STAT:          f->reg.last_operation_result = f_stat(f);   break;
-        case F_RM:            break;
-        case F_MV:            break;
+        case F_RM:            f->reg.last_operation_result = f_rm(f); break;
+#if !defined(__AVR__)
+        case F_MV:            f->reg.last_operation_result = f_mv(f); break;
+        case F_DEFRAG:        f->reg.last_operation_result = f_defrag(f); break;
+#endif
         default:              f->reg.last_operation_result = F_INCORRECT_OPERATION;
     }
     return f->reg.last_operation_result;
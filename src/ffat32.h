@@ -8,6 +8,7 @@ typedef enum FFat32Op {
     // initialization
     F_INIT           = 0x00,
     F_FSINFO_RECALC  = 0x01,
+    F_FSINFO_RECALC_STEP = 0x02,
     
     // disk operations
     F_FREE    = 0x10,
@@ -18,17 +19,24 @@ typedef enum FFat32Op {
     F_MKDIR   = 0x21,
     F_RMDIR   = 0x22,
     F_CD      = 0x23,
+    F_RMTREE  = 0x24,   // host only (not available on AVR)
+    F_MKDIR_P = 0x25,   // host only (not available on AVR)
+    F_COMPACT = 0x26,   // host only (not available on AVR)
+    F_DIRINFO = 0x27,   // host only (not available on AVR)
+    F_FIND    = 0x28,   // host only (not available on AVR)
 
     // file operations
     F_OPEN    = 0x30,
     F_CLOSE   = 0x31,
     F_READ    = 0x32,
     F_WRITE   = 0x33,
+    F_MKFILES = 0x34,   // host only (not available on AVR)
 
     // dir/file operations
     F_STAT    = 0x40,
     F_RM      = 0x41,
-    F_MV      = 0x42,
+    F_MV      = 0x42,   // host only (not available on AVR)
+    F_DEFRAG  = 0x43,   // host only (not available on AVR)
 } FFat32Op;
 
 typedef enum FFatResult {
@@ -44,6 +52,8 @@ typedef enum FFatResult {
     F_DEVICE_FULL               = 0x9,  // no space left on device
     F_DIR_NOT_EMPTY             = 0xa,  // trying to remove a non-empty directory
     F_NOT_A_DIRECTORY           = 0xb,  // trying to remove a non-directory with rmdir
+    F_FAT_CORRUPTED             = 0xc,  // a cluster chain is invalid (free, bad or out of range link, or a loop)
+    F_FILE_EXISTS               = 0xd,  // the destination of a move already exists
 } FFatResult;
 
 typedef enum FContinuation {
@@ -51,11 +61,22 @@ typedef enum FContinuation {
     F_CONTINUE   = 1,
 } FContinuation;
 
+typedef struct __attribute__((__packed__)) FFatDirInfo {   // entry returned by F_DIRINFO
+    char       name[13];       // "NAME.EXT", NUL-terminated
+    uint8_t    attrib;
+    uint32_t   cluster;        // first cluster (0 for an empty file)
+    uint32_t   size;           // in bytes
+    uint32_t   wrt_datetime;   // last modification, as in the directory entry (date << 16 | time)
+} FFatDirInfo;
+
 typedef struct FFatRegisters {
     FFatResult last_operation_result : 8;
     uint8_t    sectors_per_cluster;
     uint8_t    number_of_fats;
-    uint8_t    _unused;
+    uint8_t    state_next_entry;   // entry where F_FIND resumes, in the sector at state_next_cluster/sector
+#if !defined(__AVR__)
+    char       state_find_pattern[11];   // pattern of the F_FIND in progress, in FAT format ('?' matches any character)
+#endif
     
     uint32_t   partition_start;
     uint32_t   fat_sector_start;
@@ -63,9 +84,24 @@ typedef struct FFatRegisters {
     uint32_t   data_sector_start;
     uint32_t   root_dir_cluster;
     uint32_t   current_dir_cluster;
+    uint32_t   total_clusters;
     
     uint32_t   state_next_cluster;
     uint32_t   state_next_sector;
+    uint32_t   state_cluster_count;
+    uint32_t   state_run_last_cluster;
+    uint32_t   state_run_next_cluster;
+    
+    uint32_t   recalc_next_fat_sector;   // incremental FSINFO recalculation (F_FSINFO_RECALC_STEP)
+    uint32_t   recalc_next_free_cluster;
+    uint32_t   recalc_free_cluster_count;
+    
+#if !defined(__AVR__)
+    uint32_t   mkfiles_dir_cluster;     // directory opened by F_MKFILES (0 = none)
+    uint32_t   mkfiles_next_cluster;    // sector where the next F_MKFILES batch starts looking for free entries
+    uint32_t   mkfiles_next_sector;
+    uint32_t   mkfiles_cluster_count;
+#endif
 } FFatRegisters;
 
 typedef struct FFat32 {
@@ -73,6 +109,8 @@ typedef struct FFat32 {
     void*         data;
     bool          (*write)(uint32_t block, uint8_t const* buffer, void* data);   // implement this
     bool          (*read)(uint32_t block, uint8_t* buffer, void* data);          // implement this
+    void          (*discard)(uint32_t block, uint32_t count, void* data);        // optional (NULL): sectors no longer in use
+    bool          (*write_zeroes)(uint32_t block, uint32_t count, void* data);   // optional (NULL): fill sectors with zeroes
     FFatRegisters reg;
 } FFat32;
 
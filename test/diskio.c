@@ -15,6 +15,7 @@
 
 uint8_t* diskio_image = 0;
 uint64_t diskio_size = 0;
+void   (*diskio_before_write)(uint32_t sector, uint32_t count) = 0;   /* called before sectors are overwritten */
 
 /*-----------------------------------------------------------------------*/
 /* Get Drive Status                                                      */
@@ -56,7 +57,7 @@ DRESULT disk_read (
 )
 {
     (void) pdrv;
-    memcpy(buff, &diskio_image[sector * 512], count * 512);
+    memcpy(buff, &diskio_image[(uint64_t) sector * 512], count * 512);
 	return RES_OK;
 }
 
@@ -76,7 +77,9 @@ DRESULT disk_write (
 )
 {
     (void) pdrv;
-    memcpy(&diskio_image[sector * 512], buff, count * 512);
+    if (diskio_before_write)
+        diskio_before_write(sector, count);
+    memcpy(&diskio_image[(uint64_t) sector * 512], buff, count * 512);
 	return RES_OK;
 }
 
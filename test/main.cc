@@ -3,92 +3,257 @@
 
 #include "ff/ff.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
 
 #define GRN "\e[0;32m"
 #define RED "\e[0;31m"
+#define YLW "\e[0;33m"
 #define RST "\e[0m"
 
 extern std::vector<Test> prepare_tests();
 uint8_t buffer[512];
 bool    disk_ok = true;
+IOCount io_count;
+
+// Tests are identified by A-Z, then a-z.
+static char test_letter(size_t i)
+{
+    return i < 26 ? 'A' + i : 'a' + (i - 26);
+}
 
 static void print_test_descriptions(std::vector<Test> const& tests)
 {
-    char chr = 'A';
-    for (Test const& test: tests)
-        std::cout << chr++ << " - " << test.name << "\n";
+    for (size_t i = 0; i < tests.size(); ++i)
+        std::cout << test_letter(i) << " - " << tests[i].name << "\n";
+    std::cout << "(" YLW "$" RST " = test passed, but used more sector reads/writes than its budget)\n\n";
 }
 
 
 static void print_headers(std::vector<Test> const& tests)
 {
-    char chr = 'A';
     std::cout << std::string(43, ' ');
-    for ([[maybe_unused]] Test const& _: tests)
-        std::cout << chr++;
+    for (size_t i = 0; i < tests.size(); ++i)
+        std::cout << test_letter(i);
     std::cout << "\n";
     std::cout << std::string(80, '-') << "\n";
 }
 
 
-static void run_tests(Scenario const& scenario, std::vector<Test> const& tests, FFat32* ffat, uint8_t const* buffer)
+static bool within_budget(IOCount const& used, IOCount const& budget)
 {
-    std::cout << std::left << std::setw(43) << scenario.name;
+    return used.reads <= budget.reads && used.writes <= budget.writes;
+}
+
+
+// Result of running all tests in a scenario: the line in the report, and the budget failures found.
+struct ScenarioReport {
+    std::string              row;
+    std::vector<std::string> budget_failures;
+    bool                     ok = true;
+};
+
+
+static ScenarioReport run_tests(Scenario const& scenario, std::vector<Test> const& tests, FFat32* ffat, uint8_t const* buffer)
+{
+    ScenarioReport report;
+    std::ostringstream row;
+    row << std::left << std::setw(43) << scenario.name;
     
     for (Test const& test: tests) {
     
         scenario.prepare_scenario();
+        ffat->data = Scenario::image();
         
         FFatResult r = f_fat32(ffat, F_INIT, 0);
         if (r != F_OK) {
-            std::cout << " Error initializing FAT32 volume: " << r << "\n";
-            exit(EXIT_FAILURE);
+            row << " Error initializing FAT32 volume: " << r;
+            report.ok = false;
+            break;
         }
         
+        io_count = {};
         test.execute(ffat, scenario);
+        IOCount used = io_count;
+        
         scenario.remount();
-        if (test.verify(buffer, scenario)) {
-            std::cout << GRN "\u2713" RST;
+        if (!test.verify(buffer, scenario)) {
+            row << RED "X" RST;
+            report.ok = false;
+        } else if (test.budget && !within_budget(used, test.budget(scenario))) {
+            row << YLW "$" RST;
+            IOCount budget = test.budget(scenario);
+            report.budget_failures.emplace_back(scenario.name + " / " + test.name + ": "
+                    + std::to_string(used.reads) + " reads (budget " + std::to_string(budget.reads) + "), "
+                    + std::to_string(used.writes) + " writes (budget " + std::to_string(budget.writes) + ")");
         } else {
-            std::cout << RED "X" RST;
-            // exit(1);
+            row << GRN "\u2713" RST;
         }
-        std::cout.flush();
     
         scenario.end_scenario();
     }
     
-    std::cout << "\n";
+    report.row = row.str();
+    return report;
+}
+
+
+//
+// Each scenario runs in its own worker process, so every worker has its own image, FatFs context and library
+// state. The worker sends its report through a pipe: the first line is the row, and each following line is a
+// budget failure. Reports are collected in scenario order, so the output does not depend on which worker ends first.
+//
+
+struct Worker {
+    pid_t pid;
+    int   fd;
+};
+
+#define EXIT_TESTS_FAILED 2   // the worker sent its whole report, and some of its tests failed
+
+
+static Worker start_worker(Scenario const& scenario, std::vector<Test> const& tests, FFat32* ffat, uint8_t const* buffer)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    
+    if (pid == 0) {   // worker
+        close(fds[0]);
+        ScenarioReport report = run_tests(scenario, tests, ffat, buffer);
+        std::string message = report.row;
+        for (std::string const& failure: report.budget_failures)
+            message += "\n" + failure;
+        for (size_t written = 0; written < message.size(); ) {
+            ssize_t n = write(fds[1], message.data() + written, message.size() - written);
+            if (n <= 0)
+                _exit(EXIT_FAILURE);
+            written += n;
+        }
+        _exit(report.ok ? EXIT_SUCCESS : EXIT_TESTS_FAILED);
+    }
+    
+    close(fds[1]);
+    return { pid, fds[0] };
+}
+
+
+static ScenarioReport finish_worker(Worker const& worker, Scenario const& scenario)
+{
+    std::string message;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(worker.fd, buf, sizeof buf)) > 0)
+        message.append(buf, n);
+    close(worker.fd);
+    
+    int status;
+    waitpid(worker.pid, &status, 0);
+    
+    ScenarioReport report;
+    std::istringstream lines(message);
+    std::getline(lines, report.row);
+    for (std::string line; std::getline(lines, line); )
+        report.budget_failures.push_back(line);
+    
+    if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_TESTS_FAILED) {
+        report.ok = false;
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        report.ok = false;
+        if (report.row.empty())
+            report.row = scenario.name;
+        report.row += " " RED "(worker failed)" RST;
+    }
+    return report;
+}
+
+
+static unsigned parse_jobs(int argc, char* argv[])
+{
+    for (int i = 1; i < argc - 1; ++i)
+        if (strcmp(argv[i], "-j") == 0)
+            return std::max(1, atoi(argv[i + 1]));
+    return std::max(1U, std::thread::hardware_concurrency());
 }
 
 
-int main()
+int main(int argc, char* argv[])
 {
     FFat32 ffat {
         .buffer = buffer,
-        .data = Scenario::image(),
+        .data = nullptr,   // set for each scenario
         .write = [](uint32_t block, uint8_t const* buffer, void* data) {
-            memcpy(&((char*) data)[block * 512], buffer, 512);
+            ++io_count.writes;
+            Scenario::before_write(block);
+            memcpy(&((char*) data)[(size_t) block * 512], buffer, 512);
             return disk_ok;
         },
         .read = [](uint32_t block, uint8_t* buffer, void* data) {
-            memcpy(buffer, &((char const*) data)[block * 512], 512);
+            __atomic_fetch_add(&io_count.reads, 1, __ATOMIC_RELAXED);   // may be called from several threads (FFAT32_THREADS)
+            memcpy(buffer, &((char const*) data)[(size_t) block * 512], 512);
+            return disk_ok;
+        },
+        .discard = nullptr,
+        .write_zeroes = [](uint32_t block, uint32_t count, void* data) {
+            ++io_count.writes;   // a single command to the device
+            for (uint32_t i = 0; i < count; ++i)
+                Scenario::before_write(block + i);
+            memset(&((char*) data)[(size_t) block * 512], 0, (size_t) count * 512);
             return disk_ok;
         },
         .reg = {},
     };
     
+    unsigned jobs = parse_jobs(argc, argv);
+    
     std::vector<Test> tests = prepare_tests();
     print_test_descriptions(tests);
     print_headers(tests);
     
     auto scenarios = Scenario::all_scenarios();
-    for (Scenario const& scenario: scenarios)
-        run_tests(scenario, tests, &ffat, buffer);
+    std::vector<std::string> budget_failures;
+    bool ok = true;
+    
+    std::deque<Worker> running;
+    size_t next_to_start = 0;
+    for (size_t i = 0; i < scenarios.size(); ++i) {
+        while (next_to_start < scenarios.size() && running.size() < jobs)
+            running.push_back(start_worker(scenarios[next_to_start++], tests, &ffat, buffer));
+        
+        ScenarioReport report = finish_worker(running.front(), scenarios[i]);
+        running.pop_front();
+        
+        std::cout << report.row << "\n";
+        std::cout.flush();
+        budget_failures.insert(budget_failures.end(), report.budget_failures.begin(), report.budget_failures.end());
+        ok &= report.ok;
+    }
+    
+    if (!budget_failures.empty()) {
+        std::cout << "\nI/O budget exceeded:\n";
+        for (std::string const& failure: budget_failures)
+            std::cout << "  " << failure << "\n";
+        ok = false;
+    }
+    
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
-
@@ -1,12 +1,27 @@
 #include "scenario.hh"
 
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "ff/ff.h"
 
-uint8_t Scenario::image_[512 * 1024 * 1024] = { 0 };
-FATFS Scenario::fatfs;
+uint8_t* Scenario::image_ = nullptr;
+size_t   Scenario::image_mapped_size_ = 0;
+FATFS    Scenario::fatfs;
+
+Scenario const* Scenario::snapshot_of_ = nullptr;
+std::unordered_map<uint32_t, std::array<uint8_t, 512>> Scenario::original_sectors_;
+
+extern "C" {
+    extern uint8_t* diskio_image;
+    extern uint64_t diskio_size;
+    extern void   (*diskio_before_write)(uint32_t sector, uint32_t count);
+}
 
 PARTITION VolToPart[FF_VOLUMES] = {
         {0, 1},
@@ -35,25 +50,91 @@ std::vector<Scenario> Scenario::all_scenarios()
     scenarios.emplace_back("Disk with 512 bytes alignment", 1, DiskState::Complete, 256, 4, 512);
     scenarios.emplace_back("Disk with 2048 bytes alignment", 1, DiskState::Complete, 256, 4, 2048);
     
+    scenarios.emplace_back("Large disk (4 GB)", 1, DiskState::Complete, 4 * 1024, 8);
+    scenarios.emplace_back("Large disk (32 GB)", 1, DiskState::Complete, 32 * 1024, 32);
+    scenarios.emplace_back("Large disk (128 GB)", 1, DiskState::Complete, 128 * 1024, 64);
+    
     return scenarios;
 }
 
 void Scenario::store_image_in_disk(std::string const& filename) const
 {
     std::ofstream file(filename, std::ios::binary);
-    file.write(reinterpret_cast<char const*>(image_), (disk_size * 1024 * 1024));
+    file.write(reinterpret_cast<char const*>(image_), image_size());
 }
 
 void Scenario::prepare_scenario() const
 {
-    // setup globals
-    extern uint8_t* diskio_image;
-    extern uint64_t diskio_size;
+    // the image is built only once per scenario - for the following tests, only the sectors changed are restored
+    if (snapshot_of_ == this) {
+        restore_snapshot();
+        remount();
+    } else {
+        create_image();
+        build_image();
+        take_snapshot();
+    }
+}
+
+void Scenario::create_image() const
+{
+    if (image_)
+        munmap(image_, image_mapped_size_);
+    
+    // create an unlinked sparse file with the size of the disk
+    const char* tmpdir = getenv("TMPDIR");
+    std::string path = std::string(tmpdir ? tmpdir : "/tmp") + "/ftest-XXXXXX";
+    int fd = mkstemp(path.data());
+    if (fd < 0)
+        throw std::runtime_error("Could not create image file");
+    unlink(path.c_str());
+    if (ftruncate(fd, image_size()) != 0)
+        throw std::runtime_error("Could not resize image file");
+    
+    void* image = mmap(nullptr, image_size(), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        throw std::runtime_error("Could not map image file");
+    image_ = static_cast<uint8_t*>(image);
+    image_mapped_size_ = image_size();
     
+    // setup globals
     diskio_image = image_;
-    diskio_size = (disk_size * 1024 * 1024) / 512;
+    diskio_size = image_size() / 512;
+    diskio_before_write = [](uint32_t sector, uint32_t count) { before_write(sector, count); };
+}
+
+// Must be called before a sector in the image is overwritten, so its original contents are kept for restoring.
+void Scenario::before_write(uint32_t sector, uint32_t count)
+{
+    if (!snapshot_of_)
+        return;
+    for (uint32_t s = sector; s < sector + count; ++s) {
+        auto [it, inserted] = original_sectors_.try_emplace(s);
+        if (inserted)
+            memcpy(it->second.data(), &image_[(size_t) s * 512], 512);
+    }
+}
+
+void Scenario::take_snapshot() const
+{
+    snapshot_of_ = this;
+    original_sectors_.clear();
+}
+
+void Scenario::restore_snapshot() const
+{
+    for (auto const& [sector, data]: original_sectors_)
+        memcpy(&image_[(size_t) sector * 512], data.data(), 512);
+    original_sectors_.clear();
+}
+
+void Scenario::build_image() const
+{
+    // the snapshot is discarded while the image is rebuilt
+    snapshot_of_ = nullptr;
+    original_sectors_.clear();
     
-    // prepare image
     // clear_disk();
     partition_disk();
     format_disk();
@@ -86,7 +167,7 @@ void Scenario::remount() const
 }
 
 void Scenario::clear_disk() const {
-    memset(image_, 0, sizeof image_);
+    madvise(image_, image_size(), MADV_REMOVE);   // punch a hole over the whole file
 }
 
 void Scenario::format_disk() const
@@ -94,7 +175,7 @@ void Scenario::format_disk() const
     BYTE work[FF_MAX_SS];
     
     MKFS_PARM mkfs_parm = {
-            .fmt = FM_FAT32,
+            .fmt = (BYTE) (partitions == 0 ? FM_FAT32 | FM_SFD : FM_FAT32),
             .n_fat = 2,
             .align = alignment,
             .n_root = 0,
@@ -112,6 +193,8 @@ void Scenario::partition_disk() const
 {
     BYTE work[FF_MAX_SS];
     
+    VolToPart[0].pt = (partitions == 0) ? 0 : 1;   // raw image: volume starts at sector 0
+    
     if (partitions == 1) {
         LBA_t lba[] = { 100, 0 };
         R(f_fdisk(0, lba, work));
@@ -1,8 +1,11 @@
 #ifndef FORTUNA_FAT32_SCENARIO_HH
 #define FORTUNA_FAT32_SCENARIO_HH
 
+#include <array>
 #include <cstdint>
 #include <memory>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include "ff/ff.h"
 
@@ -10,7 +13,7 @@ class Scenario {
 public:
     enum class DiskState { Empty, Complete, Files300, Files64 };
     
-    explicit Scenario(std::string const& name, uint8_t partitions=1, DiskState disk_state=DiskState::Complete, uint16_t disk_size=256,
+    explicit Scenario(std::string const& name, uint8_t partitions=1, DiskState disk_state=DiskState::Complete, uint32_t disk_size=256,
              uint16_t sectors_per_cluster=4, uint16_t alignment=1)
              : name(name), partitions(partitions), disk_state(disk_state), disk_size(disk_size),
                sectors_per_cluster(sectors_per_cluster), alignment(alignment) {}
@@ -20,12 +23,14 @@ public:
     const std::string name;
     const uint8_t     partitions;
     const DiskState   disk_state;
-    const uint16_t    disk_size;
+    const uint32_t    disk_size;   // in MB
     const uint16_t    sectors_per_cluster;
     const uint16_t    alignment;
     
     static uint8_t* image() { return image_; }
     
+    static void before_write(uint32_t sector, uint32_t count=1);
+    
     void prepare_scenario() const;
     void end_scenario() const;
     
@@ -38,7 +43,20 @@ public:
 private:
     static FATFS fatfs;
     
-    static uint8_t image_[512 * 1024 * 1024];
+    // the image is a memory mapped sparse file, so only the sectors actually written use disk space
+    static uint8_t* image_;
+    static size_t   image_mapped_size_;
+    
+    // copy-on-write snapshot: the original contents of each sector written after the image was built
+    static Scenario const* snapshot_of_;
+    static std::unordered_map<uint32_t, std::array<uint8_t, 512>> original_sectors_;
+    
+    size_t image_size() const { return (size_t) disk_size * 1024 * 1024; }
+    
+    void create_image()     const;
+    void build_image()      const;
+    void take_snapshot()    const;
+    void restore_snapshot() const;
     
     void clear_disk()     const;
     void partition_disk() const;
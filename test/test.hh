@@ -8,16 +8,26 @@
 #include <functional>
 #include <string>
 
+// Number of sector reads/writes issued by the library through the FFat32 callbacks.
+struct IOCount {
+    uint32_t reads  = 0;
+    uint32_t writes = 0;
+};
+
 class Test {
 public:
+    using Budget = std::function<IOCount(Scenario const&)>;
+
     Test(std::string const& name,
          std::function<void(FFat32*, Scenario const&)> execute,
-         std::function<bool(uint8_t const*, Scenario const&)> verify)
-            : name(name), execute(execute), verify(verify) {}
-            
+         std::function<bool(uint8_t const*, Scenario const&)> verify,
+         Budget budget = nullptr)
+            : name(name), execute(execute), verify(verify), budget(budget) {}
+
     const std::string name;
     const std::function<void(FFat32*, Scenario const&)> execute;
     const std::function<bool(uint8_t const*, Scenario const&)> verify;
+    const Budget budget;   // maximum I/O allowed in `execute` (optional)
 };
 
 #endif
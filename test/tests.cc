@@ -6,9 +6,171 @@
 #include "helper.hh"
 
 #define BYTES_PER_SECTOR 512
+#define NUMBER_OF_FATS   2   // as formatted by Scenario::format_disk
 
 static std::vector<File> directory;
 static FFatResult result;
+static uint32_t   free_before, free_after;
+static bool       fats_match;
+static std::vector<std::pair<uint32_t, uint32_t>> discarded, expected_discarded;   // (first sector, sector count)
+
+// I/O budget helpers
+
+static uint32_t fat_size_sectors(Scenario const& scenario)
+{
+    uint32_t volume_sectors = scenario.disk_size * 2048U;
+    if (scenario.partitions == 2)
+        volume_sectors /= 2;
+    uint32_t clusters = volume_sectors / scenario.sectors_per_cluster;
+    return (clusters + 2 + (BYTES_PER_SECTOR / 4) - 1) / (BYTES_PER_SECTOR / 4);   // +2 reserved FAT entries
+}
+
+// Reads needed to list the root directory: each directory sector, plus one FAT lookup per cluster.
+static uint32_t root_listing_reads(Scenario const& scenario)
+{
+    uint32_t entries = 0;
+    switch (scenario.disk_state) {
+        case Scenario::DiskState::Empty:    entries = 1;   break;
+        case Scenario::DiskState::Complete: entries = 4;   break;
+        case Scenario::DiskState::Files64:  entries = 64;  break;
+        case Scenario::DiskState::Files300: entries = 301; break;
+    }
+    uint32_t sectors = (entries * 32 + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR;
+    uint32_t clusters = (sectors + scenario.sectors_per_cluster - 1) / scenario.sectors_per_cluster;
+    return sectors + clusters;
+}
+
+// First cluster of a file or directory, or 0 if it can't be found.
+static uint32_t stat_cluster(FFat32* f, const char* path)
+{
+    strcpy((char *) f->buffer, path);
+    if (f_fat32(f, F_STAT, 0) != F_OK)
+        return 0;
+    return *(uint16_t *) &f->buffer[26] | ((uint32_t) *(uint16_t *) &f->buffer[20] << 16);
+}
+
+// Set the next free cluster hint in FSINFO, bypassing the library.
+static void set_fsinfo_next_free(FFat32* f, uint32_t cluster)
+{
+    uint8_t sector[BYTES_PER_SECTOR];
+    f->read(f->reg.partition_start + 1, sector, f->data);
+    *(uint32_t *) &sector[0x1ec] = cluster;
+    f->write(f->reg.partition_start + 1, sector, f->data);
+}
+
+// Fill all sectors of a data cluster with `value`, bypassing the library.
+static void fill_cluster(FFat32* f, uint32_t cluster, uint8_t value)
+{
+    uint8_t sector[BYTES_PER_SECTOR];
+    memset(sector, value, BYTES_PER_SECTOR);
+    for (uint32_t i = 0; i < f->reg.sectors_per_cluster; ++i)
+        f->write((cluster - 2) * f->reg.sectors_per_cluster + f->reg.data_sector_start + i, sector, f->data);
+}
+
+// Fill all entries of a directory cluster with (unique) file entries, bypassing the library.
+static void fill_directory_cluster(FFat32* f, uint32_t cluster)
+{
+    static uint32_t file_number = 0;
+    uint8_t sector[BYTES_PER_SECTOR] = { 0 };
+    for (uint32_t i = 0; i < f->reg.sectors_per_cluster; ++i) {
+        for (uint32_t entry = 0; entry < BYTES_PER_SECTOR; entry += 32) {
+            snprintf((char *) &sector[entry], 12, "F%07u   ", file_number++);
+            sector[entry + 11] = 0x20;   // archive
+        }
+        f->write((cluster - 2) * f->reg.sectors_per_cluster + f->reg.data_sector_start + i, sector, f->data);
+    }
+}
+
+// Create `count` files in a directory with F_MKFILES, in batches of up to 13: file `i` is named `name(i)` and is
+// `size(i)` bytes long. Returns the result of the first batch that failed.
+static FFatResult create_files(FFat32* f, const char* path, int count, std::string (*name)(int), uint32_t (*size)(int))
+{
+    f->buffer[0] = F_START_OVER;
+    strcpy((char *) &f->buffer[1], path);
+    FFatResult r = f_fat32(f, F_MKFILES, 0);
+    for (int i = 0; i < count && r == F_OK; ) {
+        f->buffer[0] = F_CONTINUE;
+        uint16_t pos = 1;
+        for (int j = 0; j < 13 && i < count; ++j, ++i) {
+            pos += sprintf((char *) &f->buffer[pos], "%s", name(i).c_str()) + 1;
+            uint32_t file_size = size(i);
+            memcpy(&f->buffer[pos], &file_size, 4);
+            pos += 4;
+        }
+        f->buffer[pos] = '\0';
+        r = f_fat32(f, F_MKFILES, 0);
+    }
+    return r;
+}
+
+// Name of the file `i` in the tests that create many files: F000.TXT, F001.TXT...
+static std::string numbered_file(int i)
+{
+    char name[13];
+    snprintf(name, sizeof name, "F%03d.TXT", i);
+    return name;
+}
+
+// Number of entries in a directory (except '.' and '..'), as seen by FatFs.
+static int count_entries(const char* path)
+{
+    DIR dir;
+    FILINFO filinfo;
+    int count = 0;
+    if (f_opendir(&dir, path) != FR_OK)
+        return -1;
+    while (f_readdir(&dir, &filinfo) == FR_OK && filinfo.fname[0] != 0)
+        ++count;
+    f_closedir(&dir);
+    return count;
+}
+
+// Change a FAT entry in all FATs, bypassing the library.
+static void corrupt_fat(FFat32* f, uint32_t cluster, uint32_t value)
+{
+    uint8_t sector[BYTES_PER_SECTOR];
+    for (uint8_t i = 0; i < f->reg.number_of_fats; ++i) {
+        uint32_t block = f->reg.partition_start + f->reg.fat_sector_start + i * f->reg.fat_size_sectors + cluster / 128;
+        f->read(block, sector, f->data);
+        *(uint32_t *) &sector[(cluster % 128) * 4] = value;
+        f->write(block, sector, f->data);
+    }
+}
+
+// Mark every even free cluster as used (as a chain of one cluster) in all FATs, bypassing the library, so that no two
+// free clusters are contiguous; the first 64 clusters left free after the FSINFO hint are filled with garbage. FSINFO
+// is not updated. Returns the number of clusters marked.
+static uint32_t fragment_free_space(FFat32* f)
+{
+    uint8_t sector[BYTES_PER_SECTOR];
+    f->read(f->reg.partition_start + 1, sector, f->data);
+    uint32_t hint = *(uint32_t *) &sector[0x1ec];
+    
+    uint32_t marked = 0, filled = 0;
+    for (uint32_t fat_sector = 0; fat_sector < f->reg.fat_size_sectors; ++fat_sector) {
+        f->read(f->reg.partition_start + f->reg.fat_sector_start + fat_sector, sector, f->data);
+        bool changed = false;
+        for (uint32_t i = 0; i < 128; ++i) {
+            uint32_t cluster = fat_sector * 128 + i;
+            uint32_t* entry = (uint32_t *) &sector[i * 4];
+            if (cluster < 2 || cluster >= f->reg.total_clusters + 2 || (*entry & 0x0fffffff) != 0)
+                continue;
+            if (cluster % 2 == 0) {
+                *entry = 0x0fffffff;
+                changed = true;
+                ++marked;
+            } else if (cluster >= hint && filled < 64) {
+                fill_cluster(f, cluster, 0xaa);
+                ++filled;
+            }
+        }
+        if (changed)
+            for (uint8_t copy = 0; copy < f->reg.number_of_fats; ++copy)
+                f->write(f->reg.partition_start + f->reg.fat_sector_start + copy * f->reg.fat_size_sectors + fat_sector,
+                         sector, f->data);
+    }
+    return marked;
+}
 
 std::vector<Test> prepare_tests()
 {
@@ -30,7 +192,9 @@ std::vector<Test> prepare_tests()
                 uint32_t free_ = *(uint32_t *) buffer;
                 DWORD found = scenario.get_free_space();
                 return free_ == found;
-            }
+            },
+
+            [](Scenario const&) { return IOCount { 1, 0 }; }
     );
     
     tests.emplace_back(
@@ -44,10 +208,74 @@ std::vector<Test> prepare_tests()
             [](uint8_t const* buffer, Scenario const& scenario) {
                 uint32_t free_ = *(uint32_t *) buffer;
                 DWORD found = scenario.get_free_space();
-                return abs((int) free_ - (int) found) < 1024;
-            }
+                return free_ == found;
+            },
+
+            [](Scenario const& scenario) { return IOCount { fat_size_sectors(scenario) + 2, 1 }; }
+    );
+    
+    tests.emplace_back(
+            "Check disk space (incremental calculation)",
+            
+            [&](FFat32* ffat, Scenario const&) {
+                uint32_t fat_sectors_in_use = (ffat->reg.total_clusters + 2 + 127) / 128;
+                uint32_t expected_calls = (fat_sectors_in_use + 3) / 4;
+                uint32_t calls = 0;
+                do {
+                    ffat->buffer[0] = calls == 0 ? F_START_OVER : F_CONTINUE;
+                    ffat->buffer[1] = 4;   // FAT sectors per call
+                    result = f_fat32(ffat, F_FSINFO_RECALC_STEP, 0);
+                    ++calls;
+                } while (result == F_MORE_DATA);
+                if (calls != expected_calls)
+                    result = F_MORE_DATA;
+            },
+            
+            [&](uint8_t const* buffer, Scenario const& scenario) {
+                uint32_t free_ = *(uint32_t *) buffer;
+                return result == F_OK && free_ == scenario.get_free_space();
+            },
+            
+            [](Scenario const& scenario) { return IOCount { fat_size_sectors(scenario) + 1, 1 }; }
     );
 
+    static FFatResult continue_without_start;
+    static uint32_t   stepped_free;
+    
+    tests.emplace_back(
+            "Check disk space (incremental calculation, with changes between the steps)",
+            
+            [&](FFat32* ffat, Scenario const&) {
+                // no calculation was started since the volume was mounted
+                ffat->buffer[0] = F_CONTINUE;
+                continue_without_start = f_fat32(ffat, F_FSINFO_RECALC_STEP, 0);
+                
+                // count most of the FAT, then allocate clusters (in the sectors already counted) and finish the count
+                uint32_t fat_sectors_in_use = (ffat->reg.total_clusters + 2 + 127) / 128;
+                ffat->buffer[0] = F_START_OVER;
+                do {
+                    ffat->buffer[1] = 4;   // FAT sectors per call
+                    result = f_fat32(ffat, F_FSINFO_RECALC_STEP, 0);
+                    ffat->buffer[0] = F_CONTINUE;
+                } while (result == F_MORE_DATA && ffat->reg.recalc_next_fat_sector + 4 < fat_sectors_in_use);
+                strcpy((char *) ffat->buffer, "/NEWDIR/SUBDIR");
+                f_fat32(ffat, F_MKDIR_P, 0);
+                while (result == F_MORE_DATA) {
+                    ffat->buffer[0] = F_CONTINUE;
+                    ffat->buffer[1] = 4;
+                    result = f_fat32(ffat, F_FSINFO_RECALC_STEP, 0);
+                }
+                stepped_free = *(uint32_t *) ffat->buffer;
+                
+                f_fat32(ffat, F_FSINFO_RECALC, 0);
+                free_after = *(uint32_t *) ffat->buffer;
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                return continue_without_start == F_INCORRECT_OPERATION && result == F_OK && stepped_free == free_after;
+            }
+    );
+    
     tests.emplace_back(
             "Load boot sector",
 
@@ -59,7 +287,9 @@ std::vector<Test> prepare_tests()
                 return result == F_OK
                     && buffer[0x0] == 0xeb
                     && *(uint16_t *) &buffer[510] == 0xaa55;
-            }
+            },
+
+            [](Scenario const&) { return IOCount { 1, 0 }; }
     );
     
     // endregion
@@ -107,7 +337,9 @@ std::vector<Test> prepare_tests()
                     throw std::runtime_error("`f_opendir` reported error");
     
                 return true;
-            }
+            },
+
+            [](Scenario const& scenario) { return IOCount { root_listing_reads(scenario), 0 }; }
     );
     
     tests.emplace_back(
@@ -133,7 +365,9 @@ std::vector<Test> prepare_tests()
                 } else {
                     return result == F_PATH_NOT_FOUND;
                 }
-            }
+            },
+
+            [](Scenario const& scenario) { return IOCount { root_listing_reads(scenario) + 2, 0 }; }
     );
 
     tests.emplace_back(
@@ -159,7 +393,9 @@ std::vector<Test> prepare_tests()
                 } else {
                     return result == F_PATH_NOT_FOUND;
                 }
-            }
+            },
+
+            [](Scenario const& scenario) { return IOCount { root_listing_reads(scenario) + 2, 0 }; }
     );
     
     tests.emplace_back(
@@ -189,7 +425,9 @@ std::vector<Test> prepare_tests()
                 } else {
                     return result == F_PATH_NOT_FOUND;
                 }
-            }
+            },
+
+            [](Scenario const& scenario) { return IOCount { 2 * root_listing_reads(scenario) + 4, 0 }; }
     );
     
     tests.emplace_back(
@@ -227,7 +465,9 @@ std::vector<Test> prepare_tests()
                     return false;
                 
                 return true;
-            }
+            },
+
+            [](Scenario const&) { return IOCount { 2, 0 }; }
     );
     
     tests.emplace_back(
@@ -249,7 +489,9 @@ std::vector<Test> prepare_tests()
                     return false;
                 
                 return true;
-            }
+            },
+
+            [](Scenario const& scenario) { return IOCount { root_listing_reads(scenario) + 16, 12 }; }
     );
 
     tests.emplace_back(
@@ -273,7 +515,9 @@ std::vector<Test> prepare_tests()
                     return false;
                 
                 return true;
-            }
+            },
+
+            [](Scenario const& scenario) { return IOCount { root_listing_reads(scenario) + 20, 12 }; }
     );
     
     tests.emplace_back(
@@ -293,7 +537,9 @@ std::vector<Test> prepare_tests()
                 
                 FILINFO filinfo;
                 return f_stat("/HELLO/FORTUNA", &filinfo) == FR_NO_FILE;
-            }
+            },
+
+            [](Scenario const& scenario) { return IOCount { root_listing_reads(scenario) + 8, NUMBER_OF_FATS + 2 }; }
     );
     
     tests.emplace_back(
@@ -315,6 +561,43 @@ std::vector<Test> prepare_tests()
                 
                 FILINFO filinfo;
                 return f_stat("/HELLO/FORTUNA", &filinfo) == FR_NO_FILE;
+            },
+
+            [](Scenario const& scenario) { return IOCount { 2 * root_listing_reads(scenario) + 8, NUMBER_OF_FATS + 2 }; }
+    );
+    
+    tests.emplace_back(
+            "Remove a directory frees its clusters in all FATs",
+            
+            [&](FFat32* ffat, Scenario const&) {
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "/HELLO/FORTUNA");
+                result = f_fat32(ffat, F_STAT, 0);
+                if (result != F_OK)
+                    return;
+                uint32_t cluster = *(uint16_t *) &ffat->buffer[26] | ((uint32_t) *(uint16_t *) &ffat->buffer[20] << 16);
+                
+                f_fat32(ffat, F_FREE, 0);
+                free_before = *(uint32_t *) ffat->buffer;
+                
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "/HELLO/FORTUNA");
+                result = f_fat32(ffat, F_RMDIR, 0);
+                
+                f_fat32(ffat, F_FREE, 0);
+                free_after = *(uint32_t *) ffat->buffer;
+                
+                // compare the FAT sector containing the cluster in both FATs
+                uint8_t fat1[BYTES_PER_SECTOR], fat2[BYTES_PER_SECTOR];
+                uint32_t block = ffat->reg.partition_start + ffat->reg.fat_sector_start + cluster / 128;
+                ffat->read(block, fat1, ffat->data);
+                ffat->read(block + ffat->reg.fat_size_sectors, fat2, ffat->data);
+                fats_match = memcmp(fat1, fat2, BYTES_PER_SECTOR) == 0 && *(uint32_t *) &fat1[(cluster % 128) * 4] == 0;
+            },
+            
+            [&](uint8_t const*, Scenario const& scenario) {
+                if (scenario.disk_state != Scenario::DiskState::Complete)
+                    return result == F_PATH_NOT_FOUND;
+                
+                return result == F_OK && free_after == free_before + 1 && fats_match;
             }
     );
     
@@ -331,7 +614,9 @@ std::vector<Test> prepare_tests()
                     return true;
                 
                 return result == F_DIR_NOT_EMPTY;
-            }
+            },
+
+            [](Scenario const& scenario) { return IOCount { root_listing_reads(scenario) + 4, 0 }; }
     );
     
     tests.emplace_back(
@@ -355,6 +640,11 @@ std::vector<Test> prepare_tests()
                 
                 FILINFO filinfo;
                 return f_stat("/TEMP", &filinfo) == FR_NO_FILE;
+            },
+
+            // with 64 files, the root cluster is full: the entry goes in a cluster appended to the root directory
+            [](Scenario const& scenario) {
+                return IOCount { 2 * root_listing_reads(scenario) + 20, scenario.disk_state == Scenario::DiskState::Files64 ? 16U : 12U };
             }
     );
     
@@ -379,6 +669,246 @@ std::vector<Test> prepare_tests()
                 
                 FILINFO filinfo;
                 return f_stat("/TEMP", &filinfo) == FR_OK;
+            },
+
+            [](Scenario const& scenario) { return IOCount { 3 * root_listing_reads(scenario) + 30, 24 }; }
+    );
+    
+    static uint32_t first_cluster, second_cluster;
+    
+    tests.emplace_back(
+            "Removing a directory does not move the allocation hint back",
+            
+            [&](FFat32* ffat, Scenario const&) {
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "/TEMP");
+                f_fat32(ffat, F_MKDIR, 0);
+                first_cluster = stat_cluster(ffat, "/TEMP");
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "/TEMP");
+                result = f_fat32(ffat, F_RMDIR, 0);
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "/TEMP2");
+                f_fat32(ffat, F_MKDIR, 0);
+                second_cluster = stat_cluster(ffat, "/TEMP2");
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                return result == F_OK && first_cluster != 0 && second_cluster > first_cluster;
+            },
+            
+            [](Scenario const& scenario) { return IOCount { 5 * root_listing_reads(scenario) + 30, 32 }; }
+    );
+    
+    tests.emplace_back(
+            "Cluster allocation wraps around at the end of the volume",
+            
+            [&](FFat32* ffat, Scenario const&) {
+                set_fsinfo_next_free(ffat, ffat->reg.total_clusters + 1);   // last cluster
+                
+                extern IOCount io_count;
+                io_count = {};
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "/TEMP");
+                f_fat32(ffat, F_MKDIR, 0);
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "/TEMP2");
+                result = f_fat32(ffat, F_MKDIR, 0);
+                
+                first_cluster = stat_cluster(ffat, "/TEMP");
+                second_cluster = stat_cluster(ffat, "/TEMP2");
+                if (first_cluster != ffat->reg.total_clusters + 1)
+                    result = F_FAT_CORRUPTED;
+            },
+            
+            [&](uint8_t const*, Scenario const& scenario) {
+                if (result != F_OK)
+                    return false;
+                
+                FILINFO filinfo;
+                return second_cluster >= 2 && second_cluster < first_cluster
+                    && f_stat("/TEMP", &filinfo) == FR_OK && f_stat("/TEMP2", &filinfo) == FR_OK
+                    && scenario.get_free_space() > 0;
+            },
+            
+            // the hint wraps around to cluster 2 after the first allocation, so the second one only scans the FAT from
+            // the start up to the first free cluster; with 64 files, the root cluster is full and the first directory
+            // also appends a cluster to the root directory, that the next lookups read too
+            [](Scenario const& scenario) {
+                bool root_full = scenario.disk_state == Scenario::DiskState::Files64;
+                return IOCount { 4 * root_listing_reads(scenario) + (root_full ? 17 : 6), root_full ? 18U : 12U };
+            }
+    );
+    
+    tests.emplace_back(
+            "New directory cluster is zeroed (without write_zeroes)",
+            
+            [&](FFat32* ffat, Scenario const&) {
+                uint32_t last = ffat->reg.total_clusters + 1;
+                fill_cluster(ffat, last, 0xaa);   // garbage where the directory will be created
+                set_fsinfo_next_free(ffat, last);
+                
+                auto write_zeroes = ffat->write_zeroes;
+                ffat->write_zeroes = nullptr;
+                extern IOCount io_count;
+                io_count = {};
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "/TEMP");
+                result = f_fat32(ffat, F_MKDIR, 0);
+                ffat->write_zeroes = write_zeroes;
+                
+                if (stat_cluster(ffat, "/TEMP") != last)
+                    result = F_FAT_CORRUPTED;
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                return result == F_OK && count_entries("/TEMP") == 0;
+            },
+            
+            // when the root directory is full, it also grows, and that allocation wraps around the whole FAT
+            [](Scenario const& scenario) {
+                return IOCount { 2 * root_listing_reads(scenario) + 16, 2 * scenario.sectors_per_cluster + 12U };
+            }
+    );
+    
+    tests.emplace_back(
+            "Directory grows into a zeroed cluster after its last cluster",
+            
+            [&](FFat32* ffat, Scenario const&) {
+                uint32_t last = ffat->reg.total_clusters + 1;
+                for (uint32_t c = last - 7; c <= last; ++c)
+                    fill_cluster(ffat, c, 0xaa);   // garbage where the directory clusters will be allocated
+                set_fsinfo_next_free(ffat, last - 7);
+                
+                // directory with its first cluster full
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "/TEMP");
+                f_fat32(ffat, F_MKDIR, 0);
+                uint32_t first = stat_cluster(ffat, "/TEMP");
+                fill_directory_cluster(ffat, first);
+                
+                // the second cluster is appended to the first one, and then filled up
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "/TEMP/X");
+                f_fat32(ffat, F_MKDIR, 0);
+                uint8_t fat_sector[BYTES_PER_SECTOR];
+                ffat->read(ffat->reg.partition_start + ffat->reg.fat_sector_start + first / 128, fat_sector, ffat->data);
+                uint32_t second = *(uint32_t *) &fat_sector[(first % 128) * 4];
+                fill_directory_cluster(ffat, second);
+                auto write_zeroes = ffat->write_zeroes;
+                ffat->write_zeroes = nullptr;
+                
+                // the third cluster must be appended to the second one
+                extern IOCount io_count;
+                io_count = {};
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "/TEMP/Y");
+                result = f_fat32(ffat, F_MKDIR, 0);
+                ffat->write_zeroes = write_zeroes;
+            },
+            
+            [&](uint8_t const*, Scenario const& scenario) {
+                // the first two clusters were entirely filled by fill_directory_cluster (including '.', '..' and X)
+                int entries_per_cluster = scenario.sectors_per_cluster * BYTES_PER_SECTOR / 32;
+                FILINFO filinfo;
+                return result == F_OK && f_stat("/TEMP/Y", &filinfo) == FR_OK
+                    && count_entries("/TEMP") == 2 * entries_per_cluster + 1;
+            },
+            
+            [](Scenario const& scenario) {
+                return IOCount { root_listing_reads(scenario) + 2 * scenario.sectors_per_cluster + 16, 2 * scenario.sectors_per_cluster + 10U };
+            }
+    );
+    
+    static uint32_t dir_calls;
+    
+    tests.emplace_back(
+            "List a directory with contiguous clusters",
+            
+            [&](FFat32* ffat, Scenario const&) {
+                uint32_t last = ffat->reg.total_clusters + 1;
+                set_fsinfo_next_free(ffat, last - 7);
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "/TEMP");
+                f_fat32(ffat, F_MKDIR, 0);
+                
+                // 4 full clusters: L-7 -> L-6 -> L-5 -> L-4
+                uint32_t first = stat_cluster(ffat, "/TEMP");
+                for (uint32_t c = first; c < first + 4; ++c) {
+                    fill_directory_cluster(ffat, c);
+                    corrupt_fat(ffat, c, c == first + 3 ? 0x0fffffff : c + 1);
+                }
+                
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "/TEMP");
+                f_fat32(ffat, F_CD, 0);
+                
+                extern IOCount io_count;
+                io_count = {};
+                dir_calls = 0;
+                ffat->buffer[0] = F_START_OVER;
+                do {
+                    result = f_fat32(ffat, F_DIR, 0);
+                    ffat->buffer[0] = F_CONTINUE;
+                    ++dir_calls;
+                } while (result == F_MORE_DATA);
+            },
+            
+            [&](uint8_t const*, Scenario const& scenario) {
+                return result == F_OK && dir_calls == 4U * scenario.sectors_per_cluster;
+            },
+            
+            // every directory sector, and the FAT once (twice if the run crosses a FAT sector)
+            [](Scenario const& scenario) { return IOCount { 4U * scenario.sectors_per_cluster + 2, 0 }; }
+    );
+    
+    tests.emplace_back(
+            "Cd to a deep directory",
+            
+            [&](FFat32* ffat, Scenario const&) {
+                std::string path;
+                for (int i = 1; i <= 8; ++i) {
+                    path += "/D" + std::to_string(i);
+                    strcpy(reinterpret_cast<char*>(ffat->buffer), path.c_str());
+                    if (f_fat32(ffat, F_MKDIR, 0) != F_OK)
+                        throw std::runtime_error("Could not create directory.");
+                }
+                
+                extern IOCount io_count;
+                io_count = {};   // only the path walk counts towards the budget
+                strcpy(reinterpret_cast<char*>(ffat->buffer), path.c_str());
+                result = f_fat32(ffat, F_CD, 0);
+                IOCount used = io_count;
+                
+                // the current directory is the deepest one: relative paths are looked up from it
+                first_cluster = ffat->reg.current_dir_cluster;
+                second_cluster = stat_cluster(ffat, path.c_str());
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "SUB");
+                f_fat32(ffat, F_MKDIR, 0);
+                io_count = used;
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                if (result != F_OK || first_cluster != second_cluster)
+                    return false;
+                
+                FILINFO filinfo;
+                return f_stat("/D1/D2/D3/D4/D5/D6/D7/D8/SUB", &filinfo) == FR_OK && (filinfo.fattrib & AM_DIR);
+            },
+            
+            [](Scenario const& scenario) { return IOCount { root_listing_reads(scenario) + 2 * 8, 0 }; }
+    );
+    
+    tests.emplace_back(
+            "Directory in a cluster above 65535",
+            
+            [&](FFat32* ffat, Scenario const&) {
+                // the last cluster of the volume: on the large disks, it needs both 16-bit halves of the cluster number
+                set_fsinfo_next_free(ffat, ffat->reg.total_clusters + 1);
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "/HIGH");
+                f_fat32(ffat, F_MKDIR, 0);
+                first_cluster = stat_cluster(ffat, "/HIGH");
+                second_cluster = ffat->reg.total_clusters + 1;
+                
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "/HIGH");
+                f_fat32(ffat, F_CD, 0);
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "SUB");
+                result = f_fat32(ffat, F_MKDIR, 0);
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                FILINFO filinfo;
+                return result == F_OK && first_cluster == second_cluster
+                    && f_stat("/HIGH/SUB", &filinfo) == FR_OK && (filinfo.fattrib & AM_DIR);
             }
     );
     
@@ -406,7 +936,9 @@ std::vector<Test> prepare_tests()
                     return false;
                 
                 return (buffer[11] & 0x10) != 0;   // attr is directory
-            }
+            },
+
+            [](Scenario const& scenario) { return IOCount { root_listing_reads(scenario) + 4, 0 }; }
     );
     
     tests.emplace_back(
@@ -430,7 +962,9 @@ std::vector<Test> prepare_tests()
                 
                 uint32_t reported_size = *(uint32_t *) &buffer[28];
                 return reported_size == filinfo.fsize;
-            }
+            },
+
+            [](Scenario const& scenario) { return IOCount { root_listing_reads(scenario) + 4, 0 }; }
     );
     
     tests.emplace_back(
@@ -449,6 +983,34 @@ std::vector<Test> prepare_tests()
                     return false;
                 
                 return (buffer[11] & 0x10) != 0;   // attr is directory
+            },
+
+            [](Scenario const& scenario) { return IOCount { root_listing_reads(scenario) + 4, 0 }; }
+    );
+    
+    static FFatResult rmdir_root, rmdir_current;
+    static int        root_entries;
+    
+    tests.emplace_back(
+            "Stat and rmdir of the root directory",
+            
+            [&](FFat32* ffat, Scenario const&) {
+                root_entries = count_entries("/");
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "/");
+                rmdir_root = f_fat32(ffat, F_RMDIR, 0);
+                ffat->buffer[0] = '\0';   // the current directory (the root)
+                rmdir_current = f_fat32(ffat, F_RMDIR, 0);
+                strcpy(reinterpret_cast<char*>(ffat->buffer), "/");
+                result = f_fat32(ffat, F_STAT, 0);
+            },
+            
+            [&](uint8_t const* buffer, Scenario const&) {
+                // only the directory attribute is set in the entry returned for the root
+                uint8_t root_entry[32] = { 0 };
+                root_entry[11] = 0x10;
+                return result == F_OK && memcmp(buffer, root_entry, sizeof root_entry) == 0
+                    && rmdir_root == F_INVALID_FILENAME && rmdir_current == F_INVALID_FILENAME
+                    && count_entries("/") == root_entries;
             }
     );
     
@@ -487,9 +1049,1069 @@ std::vector<Test> prepare_tests()
             
             [&](uint8_t const*, Scenario const&) {
                 return result == F_IO_ERROR;
+            },
+
+            [](Scenario const&) { return IOCount { 1, 0 }; }
+    );
+    
+    tests.emplace_back(
+            "Remove a directory with a cyclic FAT chain",
+            
+            [&](FFat32* f, Scenario const&) {
+                strcpy((char *) f->buffer, "/HELLO/FORTUNA");
+                result = f_fat32(f, F_STAT, 0);
+                if (result != F_OK)
+                    return;
+                uint32_t cluster = *(uint16_t *) &f->buffer[26] | ((uint32_t) *(uint16_t *) &f->buffer[20] << 16);
+                corrupt_fat(f, cluster, cluster);   // cluster points to itself
+                
+                extern IOCount io_count;
+                io_count = {};
+                strcpy((char *) f->buffer, "/HELLO/FORTUNA");
+                result = f_fat32(f, F_RMDIR, 0);
+            },
+            
+            [&](uint8_t const*, Scenario const& scenario) {
+                if (scenario.disk_state != Scenario::DiskState::Complete)
+                    return result == F_PATH_NOT_FOUND;
+                
+                FILINFO filinfo;
+                return result == F_FAT_CORRUPTED && f_stat("/HELLO/FORTUNA", &filinfo) == FR_NO_FILE;
+            },
+            
+            [](Scenario const& scenario) { return IOCount { root_listing_reads(scenario) + 8, NUMBER_OF_FATS + 2 }; }
+    );
+    
+    tests.emplace_back(
+            "FAT entries with reserved bits set and any end-of-chain value",
+            
+            [&](FFat32* f, Scenario const&) {
+                uint32_t cluster = stat_cluster(f, "/HELLO/FORTUNA");
+                if (cluster == 0) {
+                    result = F_PATH_NOT_FOUND;
+                    return;
+                }
+                corrupt_fat(f, cluster, 0xfffffffa);   // end of chain, with the reserved upper bits set
+                
+                extern IOCount io_count;
+                io_count = {};
+                strcpy((char *) f->buffer, "/HELLO/FORTUNA");
+                result = f_fat32(f, F_CD, 0);
+                if (result == F_OK) {
+                    f->buffer[0] = F_START_OVER;
+                    result = f_fat32(f, F_DIR, 0);
+                }
+                if (result == F_OK) {
+                    strcpy((char *) f->buffer, "/HELLO/FORTUNA");
+                    result = f_fat32(f, F_RMDIR, 0);
+                }
+                
+                // the reserved bits are kept when the entry is freed
+                uint8_t sector[BYTES_PER_SECTOR];
+                f->read(f->reg.partition_start + f->reg.fat_sector_start + cluster / 128, sector, f->data);
+                fats_match = *(uint32_t *) &sector[(cluster % 128) * 4] == 0xf0000000;
+            },
+            
+            [&](uint8_t const*, Scenario const& scenario) {
+                if (scenario.disk_state != Scenario::DiskState::Complete)
+                    return result == F_PATH_NOT_FOUND;
+                
+                FILINFO filinfo;
+                return result == F_OK && fats_match && f_stat("/HELLO/FORTUNA", &filinfo) == FR_NO_FILE;
+            },
+            
+            [](Scenario const& scenario) {
+                return IOCount { 2 * root_listing_reads(scenario) + scenario.sectors_per_cluster + 16, NUMBER_OF_FATS + 2 };
             }
     );
     
+    tests.emplace_back(
+            "Removed clusters are discarded in contiguous runs",
+            
+            [&](FFat32* f, Scenario const&) {
+                strcpy((char *) f->buffer, "/HELLO/FORTUNA");
+                result = f_fat32(f, F_STAT, 0);
+                if (result != F_OK)
+                    return;
+                uint32_t cluster = *(uint16_t *) &f->buffer[26] | ((uint32_t) *(uint16_t *) &f->buffer[20] << 16);
+                
+                // extend the directory with clusters at the end of the disk: cluster -> L-5 -> L-4 -> L-3 -> L
+                uint32_t last = f->reg.total_clusters + 1;
+                corrupt_fat(f, cluster, last - 5);
+                corrupt_fat(f, last - 5, last - 4);
+                corrupt_fat(f, last - 4, last - 3);
+                corrupt_fat(f, last - 3, last);
+                corrupt_fat(f, last, 0x0fffffff);
+                
+                auto sector = [&](uint32_t c) { return (c - 2) * f->reg.sectors_per_cluster + f->reg.data_sector_start; };
+                uint32_t spc = f->reg.sectors_per_cluster;
+                expected_discarded = { { sector(cluster), spc }, { sector(last - 5), 3 * spc }, { sector(last), spc } };
+                
+                discarded.clear();
+                f->discard = [](uint32_t block, uint32_t count, void*) { discarded.emplace_back(block, count); };
+                extern IOCount io_count;
+                io_count = {};
+                strcpy((char *) f->buffer, "/HELLO/FORTUNA");
+                result = f_fat32(f, F_RMDIR, 0);
+                f->discard = nullptr;
+            },
+            
+            [&](uint8_t const*, Scenario const& scenario) {
+                if (scenario.disk_state != Scenario::DiskState::Complete)
+                    return result == F_PATH_NOT_FOUND;
+                
+                return result == F_OK && discarded == expected_discarded;
+            },
+            
+            // the directory has 4 clusters, in up to 3 FAT sectors
+            [](Scenario const& scenario) {
+                return IOCount { root_listing_reads(scenario) + 4 * scenario.sectors_per_cluster + 12, 3 * NUMBER_OF_FATS + 2 };
+            }
+    );
+    
+    tests.emplace_back(
+            "Defragment a directory and its subdirectory links",
+            
+            [&](FFat32* f, Scenario const&) {
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_MKDIR, 0);
+                strcpy((char *) f->buffer, "/TEMP/SUB");
+                f_fat32(f, F_MKDIR, 0);
+                first_cluster = stat_cluster(f, "/TEMP");
+                
+                // fragment the directory with (zeroed) clusters at the end of the disk: cluster -> L-5 -> L-3
+                uint32_t last = f->reg.total_clusters + 1;
+                fill_cluster(f, last - 5, 0);
+                fill_cluster(f, last - 3, 0);
+                corrupt_fat(f, first_cluster, last - 5);
+                corrupt_fat(f, last - 5, last - 3);
+                corrupt_fat(f, last - 3, 0x0fffffff);
+                
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_CD, 0);
+                f_fat32(f, F_FREE, 0);
+                free_before = *(uint32_t *) f->buffer;
+                
+                extern IOCount io_count;
+                io_count = {};
+                strcpy((char *) f->buffer, "/TEMP");
+                result = f_fat32(f, F_DEFRAG, 0);
+                
+                // the new chain is contiguous, and '.' and '..' of the subdirectory point to it
+                uint32_t cluster = stat_cluster(f, "/TEMP");
+                uint8_t sector[BYTES_PER_SECTOR];
+                auto fat_entry = [&](uint32_t c) {
+                    f->read(f->reg.partition_start + f->reg.fat_sector_start + c / 128, sector, f->data);
+                    return *(uint32_t *) &sector[(c % 128) * 4] & 0x0fffffff;
+                };
+                auto entry_cluster = [&](uint32_t c, uint32_t entry) {
+                    f->read((c - 2) * f->reg.sectors_per_cluster + f->reg.data_sector_start, sector, f->data);
+                    return *(uint16_t *) &sector[entry * 32 + 26] | ((uint32_t) *(uint16_t *) &sector[entry * 32 + 20] << 16);
+                };
+                second_cluster = stat_cluster(f, "/TEMP/SUB");
+                fats_match = cluster != first_cluster
+                        && fat_entry(cluster) == cluster + 1 && fat_entry(cluster + 1) == cluster + 2
+                        && fat_entry(cluster + 2) >= 0x0ffffff8
+                        && fat_entry(first_cluster) == 0 && fat_entry(last - 5) == 0 && fat_entry(last - 3) == 0
+                        && entry_cluster(cluster, 0) == cluster && entry_cluster(second_cluster, 1) == cluster
+                        && stat_cluster(f, "SUB") == second_cluster;   // current directory was moved too
+                
+                f_fat32(f, F_FREE, 0);
+                free_after = *(uint32_t *) f->buffer;
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                FILINFO filinfo;
+                return result == F_OK && fats_match && free_before == free_after
+                    && count_entries("/TEMP") == 1 && f_stat("/TEMP/SUB", &filinfo) == FR_OK;
+            },
+            
+            // the 3 clusters are copied; the root directory is also listed by the two checks after defragmenting
+            [](Scenario const& scenario) {
+                return IOCount { 3 * root_listing_reads(scenario) + 3 * scenario.sectors_per_cluster + 32,
+                                 3 * scenario.sectors_per_cluster + 12U };
+            }
+    );
+    
+    static uint32_t hint_cluster;
+    static bool     hint_after_chain;
+    
+    tests.emplace_back(
+            "Defragmenting starts looking for free space at the allocation hint",
+            
+            [&](FFat32* f, Scenario const&) {
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_MKDIR, 0);
+                first_cluster = stat_cluster(f, "/TEMP");
+                
+                // fragment the directory: cluster -> L-5 -> L-3, and move the hint to the middle of the volume
+                uint32_t last = f->reg.total_clusters + 1;
+                fill_cluster(f, last - 5, 0);
+                fill_cluster(f, last - 3, 0);
+                corrupt_fat(f, first_cluster, last - 5);
+                corrupt_fat(f, last - 5, last - 3);
+                corrupt_fat(f, last - 3, 0x0fffffff);
+                hint_cluster = f->reg.total_clusters / 2;
+                set_fsinfo_next_free(f, hint_cluster);
+                
+                strcpy((char *) f->buffer, "/TEMP");
+                result = f_fat32(f, F_DEFRAG, 0);
+                second_cluster = stat_cluster(f, "/TEMP");
+                
+                // the hint is moved after the new chain
+                uint8_t sector[BYTES_PER_SECTOR];
+                f->read(f->reg.partition_start + 1, sector, f->data);
+                hint_after_chain = *(uint32_t *) &sector[0x1ec] == second_cluster + 3;
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                return result == F_OK && second_cluster >= hint_cluster && second_cluster + 3 < hint_cluster + 16
+                    && hint_after_chain && count_entries("/TEMP") == 0;
+            }
+    );
+    
+    tests.emplace_back(
+            "Move a file to another directory",
+            
+            [&](FFat32* f, Scenario const&) {
+                extern IOCount io_count;
+                io_count = {};
+                strcpy((char *) f->buffer, "/HELLO/WORLD/HELLO.TXT");
+                strcpy((char *) &f->buffer[strlen("/HELLO/WORLD/HELLO.TXT") + 1], "/HELLO/MOVED.TXT");
+                result = f_fat32(f, F_MV, 0);
+            },
+            
+            [&](uint8_t const*, Scenario const& scenario) {
+                if (scenario.disk_state != Scenario::DiskState::Complete)
+                    return result == F_PATH_NOT_FOUND;
+                
+                FILINFO filinfo;
+                return result == F_OK && f_stat("/HELLO/WORLD/HELLO.TXT", &filinfo) == FR_NO_FILE
+                    && f_stat("/HELLO/MOVED.TXT", &filinfo) == FR_OK && filinfo.fsize > 0
+                    && count_entries("/HELLO/WORLD") == 0;
+            },
+            
+            // the data is not copied: only the new and the old entries are written
+            [](Scenario const& scenario) {
+                return IOCount { 2 * root_listing_reads(scenario) + 12, 2 };
+            }
+    );
+    
+    tests.emplace_back(
+            "Move a directory into another directory",
+            
+            [&](FFat32* f, Scenario const&) {
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_MKDIR, 0);
+                strcpy((char *) f->buffer, "/TEMP/SUB");
+                f_fat32(f, F_MKDIR, 0);
+                strcpy((char *) f->buffer, "/TEMP2");
+                f_fat32(f, F_MKDIR, 0);
+                first_cluster = stat_cluster(f, "/TEMP");
+                second_cluster = stat_cluster(f, "/TEMP2");
+                
+                extern IOCount io_count;
+                io_count = {};
+                strcpy((char *) f->buffer, "/TEMP");
+                strcpy((char *) &f->buffer[6], "/TEMP2/MOVED");
+                result = f_fat32(f, F_MV, 0);
+                
+                // '..' of the moved directory points to its new parent
+                uint8_t sector[BYTES_PER_SECTOR];
+                f->read((first_cluster - 2) * f->reg.sectors_per_cluster + f->reg.data_sector_start, sector, f->data);
+                fats_match = (*(uint16_t *) &sector[32 + 26] | ((uint32_t) *(uint16_t *) &sector[32 + 20] << 16)) == second_cluster;
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                FILINFO filinfo;
+                return result == F_OK && fats_match && f_stat("/TEMP", &filinfo) == FR_NO_FILE
+                    && f_stat("/TEMP2/MOVED/SUB", &filinfo) == FR_OK && count_entries("/TEMP2") == 1;
+            },
+            
+            // new entry, old entry and '..' are written
+            [](Scenario const& scenario) {
+                return IOCount { 3 * root_listing_reads(scenario) + 12, 3 };
+            }
+    );
+    
+    tests.emplace_back(
+            "Rename a directory, and moves that are not allowed",
+            
+            [&](FFat32* f, Scenario const&) {
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_MKDIR, 0);
+                strcpy((char *) f->buffer, "/TEMP/SUB");
+                f_fat32(f, F_MKDIR, 0);
+                
+                auto mv = [&](const char* from, const char* to) {
+                    strcpy((char *) f->buffer, from);
+                    strcpy((char *) &f->buffer[strlen(from) + 1], to);
+                    return f_fat32(f, F_MV, 0);
+                };
+                fats_match = mv("/TEMP", "/TEMP/SUB/TEMP") == F_INVALID_FILENAME   // inside itself
+                        && mv("/TEMP/SUB", "/TEMP/SUB") == F_FILE_EXISTS
+                        && mv("/TEMP/SUB", "/TEMP/BAD*") == F_INVALID_FILENAME
+                        && mv("/TEMP/..", "/DOTDOT") != F_OK
+                        && mv("/TEMP/NOTHERE", "/TEMP/X") == F_PATH_NOT_FOUND;
+                
+                extern IOCount io_count;
+                io_count = {};
+                result = mv("/TEMP/SUB", "/TEMP/RENAMED");
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                FILINFO filinfo;
+                return result == F_OK && fats_match && f_stat("/TEMP/SUB", &filinfo) == FR_NO_FILE
+                    && f_stat("/TEMP/RENAMED", &filinfo) == FR_OK && count_entries("/TEMP") == 1;
+            },
+            
+            // the entry is renamed in place
+            [](Scenario const& scenario) {
+                return IOCount { 2 * root_listing_reads(scenario) + 8, 1 };
+            }
+    );
+    
+    tests.emplace_back(
+            "Remove a file",
+            
+            [&](FFat32* f, Scenario const&) {
+                f_fat32(f, F_FREE, 0);
+                free_before = *(uint32_t *) f->buffer;
+                
+                extern IOCount io_count;
+                io_count = {};
+                strcpy((char *) f->buffer, "/HELLO/WORLD/HELLO.TXT");
+                result = f_fat32(f, F_RM, 0);
+                
+                f_fat32(f, F_FREE, 0);
+                free_after = *(uint32_t *) f->buffer;
+            },
+            
+            [&](uint8_t const*, Scenario const& scenario) {
+                if (scenario.disk_state != Scenario::DiskState::Complete)
+                    return result == F_PATH_NOT_FOUND;
+                
+                FILINFO filinfo;
+                return result == F_OK && f_stat("/HELLO/WORLD/HELLO.TXT", &filinfo) == FR_NO_FILE
+                    && free_after == free_before + 1 && scenario.get_free_space() == free_after
+                    && count_entries("/HELLO/WORLD") == 0;
+            },
+            
+            // entry, FAT sector (in each FAT) and FSINFO are written once
+            [](Scenario const& scenario) {
+                return IOCount { root_listing_reads(scenario) + 10, NUMBER_OF_FATS + 2 };
+            }
+    );
+    
+    tests.emplace_back(
+            "Remove a directory with F_RM, and removals that are not allowed",
+            
+            [&](FFat32* f, Scenario const&) {
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_MKDIR, 0);
+                strcpy((char *) f->buffer, "/TEMP/SUB");
+                f_fat32(f, F_MKDIR, 0);
+                
+                auto rm = [&](const char* path) {
+                    strcpy((char *) f->buffer, path);
+                    return f_fat32(f, F_RM, 0);
+                };
+                fats_match = rm("/") == F_INVALID_FILENAME && rm("/TEMP") == F_DIR_NOT_EMPTY && rm("/TEMP/X") == F_PATH_NOT_FOUND;
+                
+                result = rm("/TEMP/SUB");
+                if (result == F_OK)
+                    result = rm("/TEMP");
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                FILINFO filinfo;
+                return result == F_OK && fats_match && f_stat("/TEMP", &filinfo) == FR_NO_FILE;
+            }
+    );
+    
+    tests.emplace_back(
+            "Remove a directory tree",
+            
+            [&](FFat32* f, Scenario const&) {
+                for (const char* path: { "/TEMP", "/TEMP/A", "/TEMP/B", "/TEMP/B/C", "/TEMP/B/C/D" }) {
+                    strcpy((char *) f->buffer, path);
+                    f_fat32(f, F_MKDIR, 0);
+                }
+                f_fat32(f, F_FREE, 0);
+                free_before = *(uint32_t *) f->buffer;
+                fill_directory_cluster(f, stat_cluster(f, "/TEMP/A"));   // a cluster full of (empty) files
+                strcpy((char *) f->buffer, "/TEMP/B/C");
+                f_fat32(f, F_CD, 0);
+                
+                extern IOCount io_count;
+                io_count = {};
+                strcpy((char *) f->buffer, "/TEMP");
+                result = f_fat32(f, F_RMTREE, 0);
+                IOCount used = io_count;
+                
+                // FSINFO is consistent with the FAT, and the clusters of the 5 directories were freed
+                f_fat32(f, F_FREE, 0);
+                free_after = *(uint32_t *) f->buffer;
+                f_fat32(f, F_FSINFO_RECALC, 0);
+                fats_match = *(uint32_t *) f->buffer == free_after && f->reg.current_dir_cluster == f->reg.root_dir_cluster;
+                io_count = used;   // the checks are not part of the budget
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                FILINFO filinfo;
+                return result == F_OK && fats_match && free_after == free_before + 5 && f_stat("/TEMP", &filinfo) == FR_NO_FILE;
+            },
+            
+            // each directory sector is written once, and the FAT sectors once per directory sector
+            [](Scenario const& scenario) {
+                return IOCount { 2 * root_listing_reads(scenario) + scenario.sectors_per_cluster + 40,
+                                 scenario.sectors_per_cluster * (NUMBER_OF_FATS + 1) + 20U };
+            }
+    );
+    
+    static bool keep_intact;
+    
+    tests.emplace_back(
+            "Remove a directory tree with long filename and volume label entries",
+            
+            [&](FFat32* f, Scenario const&) {
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_MKDIR, 0);
+                create_files(f, "/", 1, [](int) -> std::string { return "KEEP.TXT"; }, [](int) -> uint32_t { return 3000; });
+                uint32_t keep = stat_cluster(f, "/KEEP.TXT");
+                
+                // after '.' and '..': a long filename entry and a volume label entry, with the cluster fields (that
+                // are name characters in a long filename entry) pointing to the chain of KEEP.TXT
+                uint8_t sector[BYTES_PER_SECTOR];
+                uint32_t block = (stat_cluster(f, "/TEMP") - 2) * f->reg.sectors_per_cluster + f->reg.data_sector_start;
+                f->read(block, sector, f->data);
+                for (uint8_t attr: { 0x0f, 0x08 }) {
+                    uint8_t* entry = &sector[(attr == 0x0f ? 2 : 3) * 32];
+                    memset(entry, 'A', 11);
+                    entry[11] = attr;
+                    *(uint16_t *) &entry[20] = keep >> 16;
+                    *(uint16_t *) &entry[26] = keep & 0xffff;
+                }
+                f->write(block, sector, f->data);
+                f_fat32(f, F_FREE, 0);
+                free_before = *(uint32_t *) f->buffer;
+                
+                strcpy((char *) f->buffer, "/TEMP");
+                result = f_fat32(f, F_RMTREE, 0);
+                
+                f_fat32(f, F_FREE, 0);
+                free_after = *(uint32_t *) f->buffer;
+                f_fat32(f, F_FSINFO_RECALC, 0);
+                fats_match = *(uint32_t *) f->buffer == free_after;
+                keep_intact = stat_cluster(f, "/KEEP.TXT") == keep;
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                // the chain of KEEP.TXT is intact: FatFs reads the whole file
+                FIL fp;
+                uint8_t data[3000];
+                UINT br = 0;
+                if (f_open(&fp, "/KEEP.TXT", FA_READ) != FR_OK || f_read(&fp, data, sizeof data, &br) != FR_OK)
+                    return false;
+                f_close(&fp);
+                FILINFO filinfo;
+                return result == F_OK && fats_match && keep_intact && br == 3000 && free_after == free_before + 1
+                    && f_stat("/TEMP", &filinfo) == FR_NO_FILE;
+            }
+    );
+    
+    tests.emplace_back(
+            "Remove a directory tree with a corrupted chain inside",
+            
+            [&](FFat32* f, Scenario const&) {
+                for (const char* path: { "/TEMP", "/TEMP/A", "/TEMP/B" }) {
+                    strcpy((char *) f->buffer, path);
+                    f_fat32(f, F_MKDIR, 0);
+                }
+                corrupt_fat(f, stat_cluster(f, "/TEMP/A"), stat_cluster(f, "/TEMP/A"));   // cluster points to itself
+                
+                strcpy((char *) f->buffer, "/TEMP");
+                result = f_fat32(f, F_RMTREE, 0);
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                FILINFO filinfo;
+                return result == F_FAT_CORRUPTED && f_stat("/TEMP", &filinfo) == FR_NO_FILE;
+            }
+    );
+    
+    tests.emplace_back(
+            "Remove a directory tree deeper than the stack",
+            
+            [&](FFat32* f, Scenario const&) {
+                std::string path = "/TEMP";
+                for (int i = 0; i < 11; ++i) {
+                    strcpy((char *) f->buffer, path.c_str());
+                    f_fat32(f, F_MKDIR, 0);
+                    path += "/D";
+                }
+                
+                extern IOCount io_count;
+                io_count = {};
+                strcpy((char *) f->buffer, "/TEMP");
+                result = f_fat32(f, F_RMTREE, 0);
+                IOCount used = io_count;
+                
+                f_fat32(f, F_FREE, 0);
+                free_after = *(uint32_t *) f->buffer;
+                f_fat32(f, F_FSINFO_RECALC, 0);
+                fats_match = *(uint32_t *) f->buffer == free_after;
+                io_count = used;
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                FILINFO filinfo;
+                return result == F_FILE_PATH_TOO_LONG && fats_match && f_stat("/TEMP", &filinfo) == FR_OK;
+            },
+            
+            [](Scenario const& scenario) {
+                return IOCount { root_listing_reads(scenario) + 30, 0 };
+            }
+    );
+    
+    tests.emplace_back(
+            "Create a directory and its missing parents",
+            
+            [&](FFat32* f, Scenario const&) {
+                extern IOCount io_count;
+                strcpy((char *) f->buffer, "/HELLO/A//B/C/");
+                result = f_fat32(f, F_MKDIR_P, 0);
+                
+                // nothing to create, and paths that go through a file
+                IOCount used = io_count;
+                strcpy((char *) f->buffer, "HELLO/A/B");
+                fats_match = f_fat32(f, F_MKDIR_P, 0) == F_OK && io_count.writes == used.writes;
+                strcpy((char *) f->buffer, "/TAGS.TXT/X");
+                FFatResult r = f_fat32(f, F_MKDIR_P, 0);
+                fats_match &= (r == F_NOT_A_DIRECTORY || r == F_OK);   // TAGS.TXT only exists in the complete disk
+                io_count = used;
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                FILINFO filinfo;
+                return result == F_OK && fats_match && f_stat("/HELLO/A/B/C", &filinfo) == FR_OK && (filinfo.fattrib & AM_DIR)
+                    && count_entries("/HELLO/A/B/C") == 0;
+            },
+            
+            // the path is walked once: the root directory is only listed again to find a free entry for HELLO; each new
+            // directory writes 6 sectors, and the root directory might grow
+            [](Scenario const& scenario) {
+                return IOCount { 2 * root_listing_reads(scenario) + 24, 4 * 6 + 8 };
+            }
+    );
+    
+    tests.emplace_back(
+            "Create many files in a directory",
+            
+            [&](FFat32* f, Scenario const&) {
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_MKDIR, 0);
+                
+                extern IOCount io_count;
+                io_count = {};
+                // 40 files, in batches of up to 13: empty, 100 bytes, and 3000 bytes
+                result = create_files(f, "/TEMP", 40, numbered_file,
+                        [](int i) -> uint32_t { return (i % 3 == 0) ? 0 : (i % 3 == 1) ? 100 : 3000; });
+                IOCount used = io_count;
+                
+                f_fat32(f, F_FREE, 0);
+                free_after = *(uint32_t *) f->buffer;
+                f_fat32(f, F_FSINFO_RECALC, 0);
+                fats_match = *(uint32_t *) f->buffer == free_after;
+                io_count = used;
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                if (result != F_OK || !fats_match || count_entries("/TEMP") != 40)
+                    return false;
+                
+                // sizes, and the contents are zeroed
+                FILINFO filinfo;
+                if (f_stat("/TEMP/F000.TXT", &filinfo) != FR_OK || filinfo.fsize != 0
+                        || f_stat("/TEMP/F037.TXT", &filinfo) != FR_OK || filinfo.fsize != 100)
+                    return false;
+                FIL fp;
+                uint8_t data[3000];
+                UINT br;
+                if (f_open(&fp, "/TEMP/F038.TXT", FA_READ) != FR_OK || f_read(&fp, data, sizeof data, &br) != FR_OK || br != 3000)
+                    return false;
+                f_close(&fp);
+                for (uint8_t byte: data)
+                    if (byte != 0)
+                        return false;
+                return true;
+            },
+            
+            // each call scans the FAT once and writes each touched FAT sector, directory sector and FSINFO once; the
+            // data clusters are zeroed (one write_zeroes per cluster); each of the 4 batches also reads the directory
+            // (at most 3 sectors, and the FAT sector to follow each of them) to check for existing names
+            [](Scenario const& scenario) {
+                uint32_t clusters_3000 = (3000 + scenario.sectors_per_cluster * BYTES_PER_SECTOR - 1) / (scenario.sectors_per_cluster * BYTES_PER_SECTOR);
+                return IOCount { root_listing_reads(scenario) + 40 + 4 * 3 * 2, 13 * (1 + clusters_3000) + 4 * (NUMBER_OF_FATS + 4) + 12 };
+            }
+    );
+    
+    static FFatResult duplicate_in_batch;
+    
+    tests.emplace_back(
+            "Create many files with repeated names",
+            
+            [&](FFat32* f, Scenario const&) {
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_MKDIR, 0);
+                f_fat32(f, F_FREE, 0);
+                free_before = *(uint32_t *) f->buffer;
+                
+                auto size_100 = [](int) -> uint32_t { return 100; };
+                create_files(f, "/TEMP", 1, [](int) -> std::string { return "OLD.TXT"; }, size_100);
+                
+                // repeated in the batch
+                duplicate_in_batch = create_files(f, "/TEMP", 3, [](int i) -> std::string { return i == 1 ? "B.TXT" : "A.TXT"; }, size_100);
+                
+                // already in the directory
+                result = create_files(f, "/TEMP", 2, [](int i) -> std::string { return i == 0 ? "C.TXT" : "OLD.TXT"; }, size_100);
+                
+                f_fat32(f, F_FREE, 0);
+                free_after = *(uint32_t *) f->buffer;
+            },
+            
+            [&](uint8_t const*, Scenario const& scenario) {
+                uint32_t cluster_size = scenario.sectors_per_cluster * BYTES_PER_SECTOR;
+                return duplicate_in_batch == F_FILE_EXISTS && result == F_FILE_EXISTS
+                    && count_entries("/TEMP") == 1 && free_after == free_before - (100 + cluster_size - 1) / cluster_size;
+            }
+    );
+    
+    tests.emplace_back(
+            "Create files while a directory is being listed",
+            
+            [&](FFat32* f, Scenario const&) {
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_MKDIR, 0);
+                create_files(f, "/TEMP", 40, numbered_file, [](int) -> uint32_t { return 0; });
+                
+                // the batches go to another directory while /TEMP is listed
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_CD, 0);
+                directory.clear();
+                f->buffer[0] = F_START_OVER;
+                result = f_fat32(f, F_DIR, 0);
+                add_files_to_dir_structure(f->buffer, directory);
+                FFatResult created = create_files(f, "/", 20, [](int i) -> std::string { return "N" + numbered_file(i); },
+                        [](int) -> uint32_t { return 100; });
+                while (result == F_MORE_DATA && created == F_OK) {
+                    f->buffer[0] = F_CONTINUE;
+                    result = f_fat32(f, F_DIR, 0);
+                    add_files_to_dir_structure(f->buffer, directory);
+                }
+                if (created != F_OK)
+                    result = created;
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                int listed = 0;
+                for (File const& file: directory)
+                    if (file.name[0] == 'F')
+                        ++listed;
+                return result == F_OK && listed == 40 && count_entries("/TEMP") == 40;
+            }
+    );
+    
+    static uint32_t fragmented_clusters;
+    
+    tests.emplace_back(
+            "Create many files on a fragmented volume",
+            
+            [&](FFat32* f, Scenario const&) {
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_MKDIR, 0);
+                
+                // no two free clusters are contiguous
+                fragmented_clusters = fragment_free_space(f);
+                f_fat32(f, F_FSINFO_RECALC, 0);
+                free_before = *(uint32_t *) f->buffer;
+                
+                result = create_files(f, "/TEMP", 3, numbered_file, [](int i) -> uint32_t { return i == 1 ? 0 : 10000; });
+                
+                f_fat32(f, F_FREE, 0);
+                free_after = *(uint32_t *) f->buffer;
+                f_fat32(f, F_FSINFO_RECALC, 0);
+                fats_match = *(uint32_t *) f->buffer == free_after;
+            },
+            
+            [&](uint8_t const*, Scenario const& scenario) {
+                uint32_t cluster_size = scenario.sectors_per_cluster * BYTES_PER_SECTOR;
+                if (fragmented_clusters == 0 || result != F_OK || !fats_match || count_entries("/TEMP") != 3
+                        || free_after != free_before - 2 * ((10000 + cluster_size - 1) / cluster_size))
+                    return false;
+                
+                // the files are read whole through the scattered chains, and the contents are zeroed
+                for (const char* path: { "/TEMP/F000.TXT", "/TEMP/F002.TXT" }) {
+                    FIL fp;
+                    uint8_t data[10000];
+                    UINT br;
+                    if (f_open(&fp, path, FA_READ) != FR_OK || f_read(&fp, data, sizeof data, &br) != FR_OK || br != 10000)
+                        return false;
+                    f_close(&fp);
+                    for (uint8_t byte: data)
+                        if (byte != 0)
+                            return false;
+                }
+                FILINFO filinfo;
+                return f_stat("/TEMP/F001.TXT", &filinfo) == FR_OK && filinfo.fsize == 0;
+            }
+    );
+    
+    static bool recompact_read_only;
+    
+    tests.emplace_back(
+            "Compact a directory with removed entries",
+            
+            [&](FFat32* f, Scenario const& scenario) {
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_MKDIR, 0);
+                
+                // 40 files of 100 bytes, then remove all but 3 of them
+                create_files(f, "/TEMP", 40, numbered_file, [](int) -> uint32_t { return 100; });
+                for (int i = 0; i < 40; ++i) {
+                    if (i == 5 || i == 17 || i == 38)
+                        continue;
+                    sprintf((char *) f->buffer, "/TEMP/F%03d.TXT", i);
+                    f_fat32(f, F_RM, 0);
+                }
+                f_fat32(f, F_FREE, 0);
+                free_before = *(uint32_t *) f->buffer;
+                
+                extern IOCount io_count;
+                io_count = {};
+                strcpy((char *) f->buffer, "/TEMP");
+                result = f_fat32(f, F_COMPACT, 0);
+                IOCount used = io_count;
+                
+                f_fat32(f, F_FREE, 0);
+                free_after = *(uint32_t *) f->buffer;
+                f_fat32(f, F_FSINFO_RECALC, 0);
+                fats_match = *(uint32_t *) f->buffer == free_after;
+                
+                // the 40 files and '.' and '..' used this many clusters: all but the first are freed
+                uint32_t dir_clusters = (42 * 32 + scenario.sectors_per_cluster * BYTES_PER_SECTOR - 1) / (scenario.sectors_per_cluster * BYTES_PER_SECTOR);
+                fats_match = fats_match && free_after - free_before == dir_clusters - 1;
+                
+                // compacting again only reads the directory
+                IOCount before = io_count;
+                strcpy((char *) f->buffer, "/TEMP");
+                recompact_read_only = f_fat32(f, F_COMPACT, 0) == F_OK && io_count.writes == before.writes
+                        && stat_cluster(f, "/TEMP/F038.TXT") != 0;
+                io_count = used;
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                if (result != F_OK || !fats_match || !recompact_read_only)
+                    return false;
+                
+                // the remaining files, in the same order
+                static const char* expected[] = { "F005.TXT", "F017.TXT", "F038.TXT" };
+                DIR dir;
+                FILINFO filinfo;
+                if (f_opendir(&dir, "/TEMP") != FR_OK)
+                    return false;
+                for (const char* name: expected)
+                    if (f_readdir(&dir, &filinfo) != FR_OK || strcmp(filinfo.fname, name) != 0 || filinfo.fsize != 100)
+                        return false;
+                bool end = f_readdir(&dir, &filinfo) == FR_OK && filinfo.fname[0] == 0;
+                f_closedir(&dir);
+                return end;
+            },
+            
+            // the directory is read once; the 3 entries are written in one sector, the rest of the cluster is zeroed,
+            // and the chain is cut after the first cluster
+            [](Scenario const& scenario) {
+                uint32_t sectors = (42 * 32 + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR;
+                return IOCount { root_listing_reads(scenario) + 2 * sectors + 6, scenario.sectors_per_cluster + 2U * NUMBER_OF_FATS + 2 };
+            }
+    );
+    
+    static bool found_before_end;
+    
+    tests.emplace_back(
+            "Lookup of a missing name stops at the end of directory marker",
+            
+            [&](FFat32* f, Scenario const&) {
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_MKDIR, 0);
+                
+                // fill the whole directory cluster, then mark the 4th entry as the end of the directory (the entries after
+                // it are not cleared)
+                uint32_t cluster = stat_cluster(f, "/TEMP");
+                fill_directory_cluster(f, cluster);
+                uint8_t sector[BYTES_PER_SECTOR];
+                uint32_t block = (cluster - 2) * f->reg.sectors_per_cluster + f->reg.data_sector_start;
+                f->read(block, sector, f->data);
+                sector[3 * 32] = 0;
+                f->write(block, sector, f->data);
+                
+                extern IOCount io_count;
+                io_count = {};
+                strcpy((char *) f->buffer, "/TEMP/NOPE.TXT");
+                result = f_fat32(f, F_STAT, 0);
+                IOCount used = io_count;
+                
+                char path[32] = "/TEMP/";
+                memcpy(&path[6], &sector[2 * 32], 8);
+                found_before_end = stat_cluster(f, path) == 0 && f->reg.last_operation_result == F_OK;
+                io_count = used;
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                return result == F_PATH_NOT_FOUND && found_before_end && count_entries("/TEMP") == 3;
+            },
+            
+            // only the first sector of the directory is read (and the FAT, for a directory with one sector per cluster)
+            [](Scenario const& scenario) { return IOCount { root_listing_reads(scenario) + 2, 0 }; }
+    );
+    
+    static bool miss_without_reads, found_after_create, found_after_move;
+    
+    tests.emplace_back(
+            "Repeated lookups of a missing file, and then creating it",
+            
+            [&](FFat32* f, Scenario const&) {
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_MKDIR, 0);
+                strcpy((char *) f->buffer, "/TEMP/NOPE.TXT");
+                f_fat32(f, F_STAT, 0);
+                
+                // the second miss doesn't read the directory: it costs the same as looking up the directory itself
+                extern IOCount io_count;
+                IOCount before = io_count;
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_STAT, 0);
+                uint32_t directory_lookup_reads = io_count.reads - before.reads;
+                
+                io_count = {};
+                strcpy((char *) f->buffer, "/TEMP/NOPE.TXT");
+                result = f_fat32(f, F_STAT, 0);
+                IOCount used = io_count;
+                miss_without_reads = used.reads == directory_lookup_reads;
+                
+                // creating the name, or moving a file to it, makes it visible
+                strcpy((char *) f->buffer, "/TEMP/NOPE.TXT");
+                f_fat32(f, F_MKDIR, 0);
+                found_after_create = stat_cluster(f, "/TEMP/NOPE.TXT") != 0;
+                
+                strcpy((char *) f->buffer, "/TEMP/OTHER");
+                f_fat32(f, F_STAT, 0);
+                memcpy(f->buffer, "/TEMP/NOPE.TXT\0/TEMP/OTHER", 27);
+                f_fat32(f, F_MV, 0);
+                found_after_move = stat_cluster(f, "/TEMP/OTHER") != 0 && stat_cluster(f, "/TEMP/NOPE.TXT") == 0;
+                io_count = used;
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                FILINFO filinfo;
+                return result == F_PATH_NOT_FOUND && miss_without_reads && found_after_create && found_after_move
+                        && f_stat("/TEMP/OTHER", &filinfo) == FR_OK && f_stat("/TEMP/NOPE.TXT", &filinfo) == FR_NO_FILE;
+            },
+            
+            // only the path up to the directory is looked up (TEMP might be in a root sector after the files)
+            [](Scenario const& scenario) { return IOCount { root_listing_reads(scenario) + 1, 0 }; }
+    );
+    
+    static bool other_reads_directory;
+    
+    tests.emplace_back(
+            "A missing file is only cached for the instance that looked it up",
+            
+            [&](FFat32* f, Scenario const&) {
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_MKDIR, 0);
+                strcpy((char *) f->buffer, "/TEMP/NOPE.TXT");
+                f_fat32(f, F_STAT, 0);
+                
+                // a second instance on the same disk reads the directory, as it didn't see the miss
+                FFat32 other = *f;
+                uint8_t other_buffer[BYTES_PER_SECTOR];
+                other.buffer = other_buffer;
+                extern IOCount io_count;
+                IOCount before = io_count;
+                strcpy((char *) other.buffer, "/TEMP");
+                f_fat32(&other, F_STAT, 0);
+                uint32_t directory_lookup_reads = io_count.reads - before.reads;
+                
+                before = io_count;
+                strcpy((char *) other.buffer, "/TEMP/NOPE.TXT");
+                result = f_fat32(&other, F_STAT, 0);
+                other_reads_directory = io_count.reads - before.reads > directory_lookup_reads;
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                return result == F_PATH_NOT_FOUND && other_reads_directory;
+            }
+    );
+    
+    tests.emplace_back(
+            "List a directory with parsed entries",
+            
+            [&](FFat32* ffat, Scenario const&) {
+                directory.clear();
+                result = F_OK;
+                ffat->buffer[0] = F_START_OVER;
+                do {
+                    FFatResult r = f_fat32(ffat, F_DIRINFO, 0);
+                    if (r != F_OK && r != F_MORE_DATA) {
+                        result = r;
+                        break;
+                    }
+                    FFatDirInfo const* info = (FFatDirInfo const*) &ffat->buffer[1];
+                    for (uint8_t i = 0; i < ffat->buffer[0]; ++i)
+                        directory.emplace_back(info[i].name, info[i].attrib & 0x10, info[i].size);
+                    ffat->buffer[0] = F_CONTINUE;
+                    result = r;
+                } while (result == F_MORE_DATA);
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                if (result != F_OK || (int) directory.size() != count_entries("/"))
+                    return false;
+                
+                DIR dp;
+                FILINFO filinfo;
+                if (f_opendir(&dp, "/") != FR_OK)
+                    return false;
+                bool found = true;
+                while (found && f_readdir(&dp, &filinfo) == FR_OK && filinfo.fname[0] != '\0')
+                    found = find_file_in_directory(&filinfo, directory);
+                f_closedir(&dp);
+                return found;
+            },
+            
+            [](Scenario const& scenario) { return IOCount { root_listing_reads(scenario), 0 }; }
+    );
+    
+    static std::vector<std::pair<std::string, uint32_t>> expected_clusters;
+    
+    tests.emplace_back(
+            "Parsed directory entries skip removed entries, and decode the clusters",
+            
+            [&](FFat32* f, Scenario const&) {
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_MKDIR, 0);
+                strcpy((char *) f->buffer, "/TEMP/A");
+                f_fat32(f, F_MKDIR, 0);
+                strcpy((char *) f->buffer, "/TEMP/B.TXT");
+                f_fat32(f, F_MKDIR, 0);
+                strcpy((char *) f->buffer, "/TEMP/C");
+                f_fat32(f, F_MKDIR, 0);
+                strcpy((char *) f->buffer, "/TEMP/B.TXT");
+                f_fat32(f, F_RM, 0);
+                expected_clusters = {
+                        { ".", stat_cluster(f, "/TEMP") }, { "..", f->reg.root_dir_cluster },
+                        { "A", stat_cluster(f, "/TEMP/A") }, { "C", stat_cluster(f, "/TEMP/C") },
+                };
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_CD, 0);
+                
+                extern IOCount io_count;
+                io_count = {};
+                f->buffer[0] = F_START_OVER;
+                result = f_fat32(f, F_DIRINFO, 0);
+                
+                // compare in execute, while the buffer has the output
+                FFatDirInfo const* info = (FFatDirInfo const*) &f->buffer[1];
+                if (f->buffer[0] != expected_clusters.size())
+                    result = F_INCORRECT_OPERATION;
+                for (size_t i = 0; i < expected_clusters.size() && result == F_OK; ++i)
+                    if (expected_clusters[i].first != info[i].name || expected_clusters[i].second != info[i].cluster
+                            || !(info[i].attrib & 0x10) || info[i].size != 0)
+                        result = F_INCORRECT_OPERATION;
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                return result == F_OK && count_entries("/TEMP") == 2;
+            },
+            
+            [](Scenario const&) { return IOCount { 2, 0 }; }
+    );
+    
+    static std::vector<std::string> found_files[3];
+    static bool find_without_matches_ok;
+    static FFatResult find_results[3];
+    static const char* find_patterns[3] = { "F*.TXT", "G00?.DAT", "*" };
+    
+    tests.emplace_back(
+            "Find files matching a pattern",
+            
+            [&](FFat32* f, Scenario const&) {
+                strcpy((char *) f->buffer, "/TEMP");
+                f_fat32(f, F_MKDIR, 0);
+                
+                // 20 files F000.TXT..F019.TXT and 10 files G000.DAT..G009.DAT
+                create_files(f, "/TEMP", 30,
+                        [](int i) {
+                            char name[13];
+                            snprintf(name, sizeof name, i < 20 ? "F%03d.TXT" : "G%03d.DAT", i % 20);
+                            return std::string(name);
+                        },
+                        [](int) -> uint32_t { return 0; });
+                
+                extern IOCount io_count;
+                IOCount used;
+                for (int i = 0; i < 3; ++i) {
+                    found_files[i].clear();
+                    if (i == 0)
+                        io_count = {};
+                    f->buffer[0] = F_START_OVER;
+                    sprintf((char *) &f->buffer[1], "/TEMP/%s", find_patterns[i]);
+                    do {
+                        find_results[i] = f_fat32(f, F_FIND, 0);
+                        FFatDirInfo const* info = (FFatDirInfo const*) &f->buffer[1];
+                        for (uint8_t j = 0; j < f->buffer[0]; ++j)
+                            found_files[i].emplace_back(info[j].name);
+                        f->buffer[0] = F_CONTINUE;
+                    } while (find_results[i] == F_MORE_DATA);
+                    if (i == 0)
+                        used = io_count;
+                }
+                
+                // a pattern without matches, and a continuation without a search in progress
+                f->buffer[0] = F_START_OVER;
+                strcpy((char *) &f->buffer[1], "/TEMP/X*");
+                find_without_matches_ok = f_fat32(f, F_FIND, 0) == F_OK && f->buffer[0] == 0;
+                f->buffer[0] = F_CONTINUE;
+                find_without_matches_ok = find_without_matches_ok && f_fat32(f, F_FIND, 0) == F_INCORRECT_OPERATION;
+                io_count = used;
+            },
+            
+            [&](uint8_t const*, Scenario const&) {
+                if (!find_without_matches_ok)
+                    return false;
+                
+                // the same files, in the same order, as FatFs
+                for (int i = 0; i < 3; ++i) {
+                    std::vector<std::string> expected;
+                    DIR dj;
+                    FILINFO fno;
+                    FRESULT fr = f_findfirst(&dj, &fno, "/TEMP", find_patterns[i]);
+                    while (fr == FR_OK && fno.fname[0] != '\0') {
+                        expected.emplace_back(fno.fname);
+                        fr = f_findnext(&dj, &fno);
+                    }
+                    f_closedir(&dj);
+                    if (find_results[i] != F_OK || found_files[i] != expected || expected.empty())
+                        return false;
+                }
+                return found_files[0].size() == 20 && found_files[1].size() == 10 && found_files[2].size() == 30;
+            },
+            
+            // "F*.TXT": the directory is read once, and the sector where a call stopped is read again by the next call
+            [](Scenario const& scenario) { return IOCount { root_listing_reads(scenario) + 1 + 4 + 4, 0 }; }
+    );
+    
     return tests;
 }
 